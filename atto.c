@@ -8,16 +8,32 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+// SIMD intrinsics for the newline scanner
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ATTO_SCAN_SIMD
+#include <immintrin.h>
+#endif
+
 /*** defines ***/
 
 // Text editor version
@@ -29,6 +45,73 @@
 // Quit confirmation
 #define ATTO_QUIT_TIMES 2
 
+// Longest time spent on a burst of input before drawing it, in ms
+#define ATTO_INPUT_BUDGET 16
+
+// Bytes read from the terminal at a time
+#define ATTO_INPUT_BUF 4096
+
+// Keys parsed ahead of being processed
+#define ATTO_KEY_QUEUE 1024
+
+// How long to wait for the rest of an escape sequence, in ms
+#define ATTO_ESC_TIMEOUT 100
+
+// How long a status message is shown, in seconds
+#define ATTO_STATUS_TIMEOUT 5
+
+// Resize events within this many ms are handled together, in ms
+#define ATTO_RESIZE_DELAY 30
+
+// Spare room left in the gap of a render string when it is rebuilt
+#define ATTO_GAP_MIN 64
+
+// Size classes of the row allocator, 16 bytes to 64KB
+#define ATTO_SLAB_MIN_SHIFT 4
+#define ATTO_SLAB_CLASSES 13
+
+// Slabs are carved out of chunks of this size
+#define ATTO_ARENA_CHUNK (1024 * 1024)
+
+// Size of each block of the append-only add buffer
+#define ATTO_ADD_BLOCK (64 * 1024)
+
+// Bytes and line breaks handled per pass of the newline scanner
+#define ATTO_SCAN_BLOCK (1024 * 1024)
+#define ATTO_SCAN_ROWS 4096
+
+// Line breaks found by the newline scanner are stored as offsets into
+// the scanned block, with this bit set when the line ends in "\r\n"
+#define ATTO_CRLF 0x80000000u
+
+// Files with at least this many bytes left to load are split across threads
+#define ATTO_PARALLEL_MIN (64 * 1024 * 1024)
+#define ATTO_LOAD_THREADS_MAX 64
+
+// Bytes handed over at a time by the background loader
+#define ATTO_LOAD_BATCH (16 * 1024 * 1024)
+
+// Rows per leaf and children per inner node of the row store
+#define ATTO_LEAF_ROWS 64
+#define ATTO_INNER_NODES 32
+
+// Pieces of text handed to `writev()` at a time when saving
+#define ATTO_SAVE_IOV 1024
+
+// Full saves go through a temporary file renamed over the original, so
+// they never leave the file half written (0 to overwrite it in place)
+#define ATTO_ATOMIC_SAVE 1
+
+// Save by writing over the file in place from the first changed row on,
+// when that is safe. What is about to be written goes to a redo file
+// first, so a save cut short by a crash is finished the next time the
+// file is opened (0 to always save the whole file)
+#define ATTO_INCREMENTAL_SAVE 1
+
+// Milliseconds an edit may wait before it is written to the recovery
+// journal, so a burst of typing costs one write and one `fdatasync()`
+#define ATTO_JOURNAL_DELAY 500
+
 // Input for (Ctrl + Something)
 // Ctrl key combined with alphabetical keys produce 1-26
 #define CTRL_KEY(k) ((k) & 0x1F)
@@ -45,23 +128,309 @@ enum editorKey
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,    // Start of a bracketed paste
+    PASTE           // Pasted text, waiting in `E.input.paste`
+};
+
+// Edits logged to the recovery journal
+enum journalOp
+{
+    JOURNAL_CHAR = 1,   // `editorInsertChar()`
+    JOURNAL_TEXT,       // `editorInsertText()`
+    JOURNAL_NEWLINE,    // `editorInsertNewLine()`
+    JOURNAL_DELETE      // `editorDelChar()`
 };
 
 /*** Data ***/
 
+// A span of text inside the text buffer (either the original file
+// buffer or the add buffer). The text a piece points to is never modified.
+typedef struct piece
+{
+    char* start;
+    int len;
+} piece;
+
+// State of the `render` string of a row
+enum erowFlags
+{
+    ROW_STALE = 1,  // `render` is out of date and is rebuilt when next drawn
+    ROW_GAP = 2     // `render` is owned and has a gap, otherwise it points into the text buffer
+};
+
 // Contents of each row
 typedef struct erow
 {
     int size;
+    int flags;
     int rsize;      // Size of the contents of render
-    char* chars;
-    char* render;   // Actual string to render
+    int npieces;    // Number of pieces making up the row
+    int piececap;   // Capacity of `pieces` (0 while the row uses `inl`)
+    int gap;        // Offset of the gap in `render`, with `ROW_GAP`
+    piece* pieces;
+    piece inl;      // Single piece stored inline, so loaded rows need no allocation
+    char* render;   // Actual string to render (not NUL-terminated)
 } erow;
 
+// Tab in the text of a row
+struct tabStop
+{
+    int cx;     // Text index of the tab
+    int rx;     // Render index just after it
+};
+
+// Owned render string of a row. The rendered text is split around a gap
+// at the last edit, so typing there only touches a byte or two.
+struct rowGap
+{
+    int cap;                // Size of `text`, counting the gap
+    int ntabs;              // Tabs in the row
+    int tabcap;             // Capacity of `tabs`
+    int tabgap;             // Tabs stored before the gap in `tabs`
+    struct tabStop* tabs;   // Tab index of the row, see `editorRowTab()`
+    char text[];            // What `render` points to
+};
+
+// Node of the row store, a B-tree of rows indexed by line number.
+// Leaves hold the rows themselves and inner nodes hold their children
+// along with the number of rows below each of them.
+typedef struct rowNode
+{
+    int leaf;   // 0 for an inner node, otherwise a `rowLeafKind`
+    int n;      // Number of rows (leaf) or children (inner node)
+} rowNode;
+
+// Kinds of leaf in the row store
+enum rowLeafKind
+{
+    LEAF_ROWS = 1,  // `rowLeaf`, holding its rows
+    LEAF_LAZY       // `rowLazy`, whose rows are only built once needed
+};
+
+typedef struct rowLeaf
+{
+    rowNode hdr;
+    erow rows[ATTO_LEAF_ROWS];
+} rowLeaf;
+
+// Leaf of rows counted by the background loader but not built yet: the
+// `hdr.n` lines in the `len` bytes at `start` in the original buffer.
+// Inner nodes build it into a `rowLeaf` when it is first reached.
+typedef struct rowLazy
+{
+    rowNode hdr;
+    size_t start;
+    size_t len;
+} rowLazy;
+
+typedef struct rowInner
+{
+    rowNode hdr;
+    int count[ATTO_INNER_NODES];
+    rowNode* child[ATTO_INNER_NODES];
+} rowInner;
+
+// Block of the append-only add buffer. Blocks are never moved or
+// reallocated, so pieces can point straight into them.
+struct addBlock
+{
+    struct addBlock* next;
+    int len;
+    int cap;
+    char data[];
+};
+
+// Chunk of memory obtained by the row allocator from `malloc()`
+struct arenaBlock
+{
+    struct arenaBlock* next;
+    struct arenaBlock* prev;
+};
+
+// Space taken by the header of an `arenaBlock`, keeping what follows aligned
+#define ARENA_HDR ((sizeof(struct arenaBlock) + 15) & ~(size_t)15)
+
+// Counters kept by the row allocator
+struct arenaStats
+{
+    long allocs;        // Allocations served
+    long reused;        // Allocations served from a free list
+    long frees;
+    long sysallocs;     // Calls made to `malloc()`
+    size_t requested;   // Bytes currently asked for
+    size_t used;        // Bytes currently handed out, rounded up to size classes
+    size_t reserved;    // Bytes obtained from `malloc()`
+};
+
+// Allocator owning the memory of the rows. Small allocations come from
+// power-of-two size classes, carved out of large chunks by bumping a
+// pointer and recycled through a free list per class. Everything can
+// be released at once.
+struct arena
+{
+    void* freelist[ATTO_SLAB_CLASSES];
+    char* bump;
+    size_t bumpleft;
+    struct arenaBlock* chunks;
+    struct arenaBlock* large;   // Allocations bigger than the largest class
+    struct arenaStats stats;
+};
+
+// Piece table storage: the original file contents plus an append-only
+// buffer holding every piece of text typed since
+struct textBuffer
+{
+    char* orig;
+    size_t origlen;
+    int mapped;             // `orig` is a read-only mapping of the file
+    long pagesize;          // Page size of the mapping
+    volatile sig_atomic_t cut;  // The mapped file was cut short on disk
+    size_t indexed;         // Bytes of `orig` already split into rows
+    struct addBlock* add;   // Newest block first
+    struct arena arena;     // Memory of the rows, row store and add buffer
+};
+
+// Rows split off by the background loader, waiting to be added to the row store
+struct loadBatch
+{
+    struct loadBatch* next;
+    rowLazy* leaves;
+    int nleaves;
+    size_t end;     // Offset into the original buffer just past these rows
+};
+
+// Background loading of the rows that the first screen did not need
+struct fileLoader
+{
+    int active;
+    int maxthreads;         // Worker threads per batch (0 for one per CPU)
+    size_t from;            // Offset the loader started at
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // Signalled when a batch is queued or loading ends
+    int wake[2];            // Pipe written at the same time, to wake up `poll()`
+    struct loadBatch* head;
+    struct loadBatch* tail;
+    int done;
+};
+
+// Hashes of the lines last written to the terminal, so that lines that
+// have not changed since are not sent again
+struct screenState
+{
+    uint64_t* hashes;   // One per terminal line
+    int nlines;
+    int valid;          // Whether `hashes` matches what is on the terminal
+    int rowoff;         // `E.rowoff` of the last frame
+    int scroll;         // Whether the terminal supports scroll regions
+    int sync;           // Whether it supports synchronized output
+    int cx;             // Cursor position last sent
+    int cy;
+};
+
+// Input read from the terminal but not processed yet
+struct inputState
+{
+    unsigned char buf[ATTO_INPUT_BUF];
+    int pos;                    // Next byte of `buf` to parse
+    int len;
+    int keys[ATTO_KEY_QUEUE];   // Ring of parsed keys
+    int khead;
+    int ktail;
+    int skipping;               // Dropping the rest of a sequence too long for `buf`
+    int pasting;                // Inside a bracketed paste
+    char* paste;                // Text of the paste so far
+    int pastelen;
+    int pastecap;
+};
+
+// A save running on a writer thread. The text is written from a snapshot
+// of where it lies in the text buffer, which is never modified, so the
+// rows can go on being edited in the meantime.
+struct saveJob
+{
+    int active;
+    pthread_t thread;
+    int wake[2];            // Written when the save is done, to wake up `poll()`
+    char* filename;
+    struct iovec* iov;      // The text of the file, in order
+    int niov;
+    int iovcap;
+    size_t len;
+    size_t same;            // Bytes at the start that lie where they were in `E.tb.orig`
+    size_t from;            // Offset of the first row that changed
+    size_t rewritten;       // Bytes the save actually wrote
+    int dirty;              // `E.dirty` when the snapshot was taken
+    int dirtyrow;           // `E.dirtyrow` when the snapshot was taken
+    int err;                // `errno` if the save failed, otherwise 0
+    int known;              // `disk` is the file as it was last read or written
+    int verbatim;           // The file has not been saved since it was opened
+    struct stat disk;
+    struct stat loaded;     // The file `E.tb.orig` was read from
+};
+
+// Start of a journal file, naming the version of the file on disk that
+// its edits apply to
+struct journalHeader
+{
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+};
+
+// An edit in the journal, made with the cursor at `row` and `col`, and
+// followed by `len` bytes of text
+struct journalRecord
+{
+    uint32_t op;
+    uint32_t row;
+    uint32_t col;
+    uint32_t len;
+};
+
+// Start of the redo file an incremental save writes before it writes over
+// the file: the file, the version of it the journal was written against,
+// and what it is once saved. The text to write follows as `saveExtent`s,
+// each followed by its bytes. `magic` goes last, once the rest is on disk.
+struct saveRedo
+{
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;              // Length of the file once saved
+    uint64_t saved;             // Journal size when the snapshot was taken
+    struct journalHeader base;  // Header of the journal the save is for
+};
+
+// Text of a redo file, to be written at `off` in the file
+struct saveExtent
+{
+    uint64_t off;
+    uint64_t len;
+};
+
+// Edits made since the last save, logged to a file next to the one being
+// edited so they can be recovered after a crash. Records are gathered in
+// memory and written and synced together every ATTO_JOURNAL_DELAY ms.
+struct journal
+{
+    int fd;                 // -1 until there is something to write
+    char* name;
+    char* buf;              // Records not written yet
+    size_t len;
+    size_t cap;
+    off_t size;             // Bytes in the file
+    off_t saved;            // `size` when the running save took its snapshot
+    long long commit_time;  // When to write out `buf` (0 if empty)
+    int replaying;          // Edits come from the journal, so aren't logged
+    int kept;               // An older journal was kept, so nothing is logged over it
+};
+
 struct editorConfig
 {
-    // Cursor location (index into chars field of an erow)
+    // Cursor location (index into the text of an erow)
     int cx;
     int cy;
 
@@ -78,11 +447,26 @@ struct editorConfig
 
     // Contents of each row
     int numrows;
-    erow* row;
+    rowNode* rows;
+
+    // Text referenced by the rows
+    struct textBuffer tb;
+
+    // Loads the rest of the file while the editor is already running
+    struct fileLoader load;
+
+    // Writes the file while the editor is already running
+    struct saveJob save;
+
+    // Unsaved edits, kept on disk to recover them after a crash
+    struct journal journal;
 
     // Dirty flag (Unsaved changes)
     int dirty;
 
+    // First row that may differ from the file on disk
+    int dirtyrow;
+
     // Name of file opened
     char* filename;
 
@@ -90,6 +474,18 @@ struct editorConfig
     char statusmsg[80];
     time_t statusmsg_time;
 
+    // What the terminal currently shows
+    struct screenState screen;
+
+    // Keys on their way in
+    struct inputState input;
+
+    // SIGWINCH and SIGTERM, read like input instead of interrupting
+    int sigfd;
+
+    // When to apply a pending terminal resize (0 if none)
+    long long resize_time;
+
     // Save a copy of termios in its original state
     struct termios orig_termios;
 };
@@ -100,7 +496,18 @@ struct editorConfig E;
 
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen();
+void editorResize();
 char* editorPrompt(char* prompt);
+int editorLoadPoll(int wait);
+int editorSplitRows(char* p, size_t len, int last, erow* rows, int max, size_t* used);
+void editorMakeRow(erow* row, char* s, size_t len);
+void editorSaveFinish();
+void editorJournalAdd(int op, const char* s, int len);
+void editorJournalCommit();
+void editorJournalSaved();
+char* editorJournalName(const char* filename, const char* ext);
+void editorJournalFinishSave(const char* filename);
+void editorJournalRecover(struct stat* st);
 
 /*** Terminal ***/
 
@@ -124,6 +531,9 @@ void die(const char *s)
 // ----------------
 void disableRawMode()
 {
+    // Stop bracketing pastes
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     {
         die("tcsetattr");
@@ -188,511 +598,4125 @@ void enableRawMode()
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | ISIG);
 
-    // Timeout for `read()`
+    // `read()` returns at once with whatever is there. Waiting for input
+    // is done with `poll()` instead, see `editorWaitEvent()`.
     // --------------------
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     // Terminal attributes can be applied to the terminal after modifying with `tcsetattr`
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     {
         die("tcsetattr");
     }
+
+    // Have the terminal mark pasted text with `ESC [ 200 ~` and
+    // `ESC [ 201 ~`, so a paste can be inserted in one go
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-// ----------------------------
-// Read Key From Standard Input
-// ----------------------------
-int editorReadKey()
+// Keys for the final byte of a CSI (`ESC [`) or SS3 (`ESC O`) sequence
+static const int keyFinal[128] = {
+    ['A'] = ARROW_UP,
+    ['B'] = ARROW_DOWN,
+    ['C'] = ARROW_RIGHT,
+    ['D'] = ARROW_LEFT,
+    ['H'] = HOME_KEY,
+    ['F'] = END_KEY
+};
+
+// Keys for `ESC [ n ~` sequences, by `n`
+static const int keyTilde[] = {
+    [1] = HOME_KEY,
+    [3] = DEL_KEY,
+    [4] = END_KEY,
+    [5] = PAGE_UP,
+    [6] = PAGE_DOWN,
+    [7] = HOME_KEY,
+    [8] = END_KEY
+};
+
+// -------------------------------------------------------------------
+// Parse the key at the start of `s`. Returns the number of bytes it
+// takes up, or 0 if the sequence is cut short and more input is needed.
+// `*key` is 0 for sequences that aren't keys the editor knows.
+// -------------------------------------------------------------------
+int editorParseKey(const unsigned char* s, int len, int* key)
 {
-    int nread;
-    char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1)
-    {
-        if(nread == -1 && errno != EAGAIN)
-        {
-            die("read");
-        }
-    }
+    enum { KEY_START, KEY_ESC, KEY_CSI, KEY_SS3 } state = KEY_START;
+    int param[2] = { 0, 0 };
+    int nparam = 0;
 
-    // Read key presses with multiple bytes
-    // Example : Arrow keys are in the form `\x1b`, `[`, followed by an `A`, `B`, `C`, or `D`.
-    if(c == '\x1b')
+    int i;
+    for(i = 0; i < len; ++i)
     {
-        char seq[3];
+        unsigned char c = s[i];
 
-        if(read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
+        switch(state)
+        {
+            case KEY_START:
+                if(c != '\x1b')
+                {
+                    *key = c;
+                    return 1;
+                }
+                state = KEY_ESC;
+                break;
 
-        if(read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
+            case KEY_ESC:
+                if(c == '[')
+                {
+                    state = KEY_CSI;
+                    break;
+                }
+                if(c == 'O')
+                {
+                    state = KEY_SS3;
+                    break;
+                }
 
-        if(seq[0] == '[')
-        {
-            if(seq[1] >= '0' && seq[1] <= '9')
-            {
-                if(read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
+                // Anything else is the escape key on its own
+                *key = '\x1b';
+                return 1;
 
-                if(seq[2] == '~')
+            case KEY_CSI:
+                // Parameters, separated by ';'. Any after the second one
+                // are ignored.
+                if(c >= '0' && c <= '9')
                 {
-                    switch(seq[1])
-                    {
-                        case '1':
-                            return HOME_KEY;
-                        case '3':
-                            return DEL_KEY;
-                        case '4':
-                            return END_KEY;
-                        case '5':
-                            return PAGE_UP;
-                        case '6':
-                            return PAGE_DOWN;
-                        case '7':
-                            return HOME_KEY;
-                        case '8':
-                            return END_KEY;
-                    }
+                    if(nparam < 2 && param[nparam] < 10000)
+                        param[nparam] = param[nparam] * 10 + (c - '0');
+                    break;
                 }
-            }
-            else
-            {
-                switch (seq[1])
+                if(c == ';')
                 {
-                    // Arrow Keys
-                    case 'A':
-                        return ARROW_UP;
-                    case 'B':
-                        return ARROW_DOWN;
-                    case 'C':
-                        return ARROW_RIGHT;
-                    case 'D':
-                        return ARROW_LEFT;
-
-                    case 'H':
-                        return HOME_KEY;
-                    case 'F':
-                        return END_KEY;
+                    ++nparam;
+                    break;
                 }
-            }
-        }
-        else if(seq[0] == 'O')
-        {
-            switch(seq[1])
-            {
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-            }
+
+                // Other parameter and intermediate bytes
+                if(c >= 0x20 && c <= 0x3f)
+                    break;
+
+                // A final byte ends the sequence. Modifiers (the second
+                // parameter) are dropped, so Shift, Alt or Ctrl with a key
+                // acts like the key alone.
+                if(c >= 0x40 && c <= 0x7e)
+                {
+                    if(c == '~' && param[0] == 200)
+                        *key = PASTE_START;
+                    else if(c == '~')
+                        *key = (param[0] < (int)(sizeof(keyTilde) / sizeof(keyTilde[0]))) ? keyTilde[param[0]] : 0;
+                    else
+                        *key = keyFinal[c];
+                    return i + 1;
+                }
+
+                // Not a valid sequence, so take the escape key alone
+                *key = '\x1b';
+                return 1;
+
+            case KEY_SS3:
+                *key = (c < 128) ? keyFinal[c] : 0;
+                return i + 1;
         }
-        return '\x1b';
-    }
-    else
-    {
-        return c;
     }
+
+    return 0;
 }
 
-// ------------------------------
-// Get Current Position of Cursor
-// ------------------------------
-int getCursorPosition(int* rows, int* cols)
+// ----------------------------------------------------------------------
+// Move pasted text from the input buffer to the paste buffer. The end of
+// the paste may be cut short too, so without `force` anything that could
+// be the start of it is left in the input buffer. Returns 1 once the end
+// of the paste has been reached.
+// ----------------------------------------------------------------------
+int editorCollectPaste(int force)
 {
-    char buf[32];
-    unsigned int i = 0;
+    static const char end[] = "\x1b[201~";
+    int endlen = sizeof(end) - 1;
 
-    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-    {
-        return -1;
-    }
+    struct inputState* in = &E.input;
+    char* s = (char*)&in->buf[in->pos];
+    int len = in->len - in->pos;
 
-    while(i < sizeof(buf) - 1)
+    char* e = memmem(s, len, end, endlen);
+    int n = e ? e - s : len;
+
+    if(e == NULL && !force)
     {
-        if(read(STDIN_FILENO, &buf[i], 1) != 1)
+        int k = n < endlen - 1 ? n : endlen - 1;
+        while(k > 0 && memcmp(&s[n - k], end, k) != 0)
         {
-            break;
+            --k;
         }
+        n -= k;
+    }
 
-        if(buf[i] == 'R')
+    if(in->pastelen + n > in->pastecap)
+    {
+        int cap = in->pastecap ? in->pastecap * 2 : ATTO_INPUT_BUF;
+        while(cap < in->pastelen + n)
         {
-            break;
+            cap *= 2;
         }
 
-        ++i;
+        in->paste = realloc(in->paste, cap);
+        if(in->paste == NULL)
+            die("realloc");
+        in->pastecap = cap;
     }
 
-    buf[i] = '\0';
+    memcpy(&in->paste[in->pastelen], s, n);
+    in->pastelen += n;
+    in->pos += n;
 
-    if(buf[0] != '\x1b' || buf[1] != '[')
-        return -1;
-    if(sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-        return -1;
+    if(e == NULL)
+        return 0;
 
-    return 0;
+    in->pos += endlen;
+    in->pasting = 0;
+    return 1;
 }
 
-// ----------------------------
-// Get The Size of The Terminal
-// ----------------------------
-int getWindowSize(int* rows, int* cols)
+// -------------------------------------------------------------------
+// Parse the complete keys in the input buffer into the key queue. With
+// `force`, a sequence cut short is taken as the escape key on its own.
+// -------------------------------------------------------------------
+void editorParseInput(int force)
 {
-    struct winsize ws;
+    struct inputState* in = &E.input;
 
-    // We can get the size of the terminal by simply calling ioctl()
-    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    while(in->pos < in->len && (in->ktail + 1) % ATTO_KEY_QUEUE != in->khead)
     {
-        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+        // Up to and including the final byte of the sequence
+        if(in->skipping)
         {
-            return -1;
+            unsigned char c = in->buf[in->pos++];
+            if(c >= 0x40 && c <= 0x7e)
+                in->skipping = 0;
+            continue;
         }
-        return getCursorPosition(rows, cols);
-    }
-    else
-    {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
 
-    }
-}
+        if(in->pasting)
+        {
+            if(!editorCollectPaste(force))
+                break;
 
-/*** Row Operations ***/
+            // Nothing after a paste is parsed until the paste has been
+            // inserted, as the paste buffer only holds one
+            in->keys[in->ktail] = PASTE;
+            in->ktail = (in->ktail + 1) % ATTO_KEY_QUEUE;
+            return;
+        }
 
-// -------------------------------------------
-// Convert `chars` index into a `render` index
-// -------------------------------------------
-int editorRowCxToRx(erow* row, int cx)
-{
-    int rx = 0;
+        int key;
+        int n = editorParseKey(&in->buf[in->pos], in->len - in->pos, &key);
 
-    int j;
-    for(j = 0; j < cx; ++j)
-    {
-        if(row->chars[j] == '\t')
+        if(n == 0)
         {
-            rx += (ATTO_TAB_STOP - 1) - (rx % ATTO_TAB_STOP);
+            if(!force)
+                break;
+
+            key = '\x1b';
+            n = 1;
         }
-        ++rx;
-    }
 
-    return rx;
+        in->pos += n;
+
+        if(key == PASTE_START)
+        {
+            in->pasting = 1;
+        }
+        else if(key != 0)
+        {
+            in->keys[in->ktail] = key;
+            in->ktail = (in->ktail + 1) % ATTO_KEY_QUEUE;
+        }
+    }
 }
 
-// -------------------------------------------------------------------------------
-// Uses the `chars` string of an `erow` to fill in the contents of `render` string
-// -------------------------------------------------------------------------------
-void editorUpdateRow(erow* row)
+// ----------------------------------------------------------------------
+// Read whatever input is available, up to the free space in the buffer.
+// Returns the number of bytes read, 0 once the read times out, or -1 if
+// it was interrupted by a signal.
+// ----------------------------------------------------------------------
+int editorFillInput()
 {
-    int tabs = 0;
+    struct inputState* in = &E.input;
 
-    int j;
-    for(j = 0; j < row->size; ++j)
+    // Move a partial sequence left over to the front
+    if(in->pos > 0)
     {
-        if(row->chars[j] == '\t')
-            ++tabs;
+        memmove(in->buf, &in->buf[in->pos], in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(ATTO_TAB_STOP - 1) + 1);
+    // The buffer is full of a single sequence that is still cut short,
+    // such as a CSI with very long parameters. It can't be a key, so drop
+    // it, along with the rest of it still to come.
+    if(in->len == ATTO_INPUT_BUF)
+    {
+        in->len = 0;
+        in->skipping = 1;
+    }
 
-    int idx = 0;
-    for(j = 0; j < row->size; ++j)
+    int nread = read(STDIN_FILENO, &in->buf[in->len], ATTO_INPUT_BUF - in->len);
+    if(nread == -1)
     {
-        if(row->chars[j] == '\t')
-        {
-            // Render tabs as 4 spaces
-            row->render[idx++] = ' ';
-            while(idx % ATTO_TAB_STOP != 0)
-            {
-                row->render[idx++] = ' ';
-            }
-        }
-        else
-        {
-            row->render[idx++] = row->chars[j];
-        }
+        if(errno == EINTR)
+            return -1;
+        if(errno != EAGAIN)
+            die("read");
+        return 0;
     }
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    in->len += nread;
+    return nread;
 }
 
-
-// ----------------------------------------------------------------
-// Insert a row of text at the index specified by the `at` argument
-// ----------------------------------------------------------------
-void editorInsertRow(int at, char* s, size_t len)
+// ----------------------------------------
+// Whether input is waiting to be processed
+// ----------------------------------------
+int editorInputPending()
 {
-    // If `at` row not within boundaries
-    if(at < 0 || at > E.numrows)
-        return;
+    if(E.input.khead != E.input.ktail || E.input.pos < E.input.len)
+        return 1;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// ------------------------------------------------------------------
+// Wait until the terminal can take a frame without blocking. Returns
+// 0 instead if input arrives first, so the frame can be skipped.
+// ------------------------------------------------------------------
+int editorWaitOutput()
+{
+    struct pollfd pfd[2] = {
+        { STDOUT_FILENO, POLLOUT, 0 },
+        { STDIN_FILENO, POLLIN, 0 }
+    };
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+    while(poll(pfd, 2, -1) == -1)
+    {
+        if(errno != EINTR && errno != EAGAIN)
+            die("poll");
+    }
 
-    ++E.numrows;
-    ++E.dirty;
+    return (pfd[0].revents & POLLOUT) || !(pfd[1].revents & POLLIN);
 }
 
-// --------------------------------------------------
-// Freeing the memory owned by `erow` we are deleting
-// --------------------------------------------------
-void editorFreeRow(erow* row)
+// ----------------------------
+// Monotonic time in milliseconds
+// ----------------------------
+long long editorNowMs()
 {
-    free(row->render);
-    free(row->chars);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-// --------------
-// Deleting a row
-// --------------
-void editorDelRow(int at)
+// ----------------------------------------------------------------
+// Block SIGWINCH and SIGTERM and read them from a `signalfd` in the
+// event loop instead, so a signal can never land in the middle of a
+// `read()` or `write()`. Must be called before any thread is started.
+// ----------------------------------------------------------------
+void enableSignals()
 {
-    if(at < 0 || at >= E.numrows)
-        return;
-    
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    --E.numrows;
-    ++E.dirty;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGTERM);
+
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        die("sigprocmask");
+
+    E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(E.sigfd == -1)
+        die("signalfd");
 }
 
-// -----------------------------------
-// Insert single character into `erow`
-// -----------------------------------
-void editorRowInsertChar(erow* row, int at, int c)
+// --------------------------------------
+// Handle the signals that have arrived
+// --------------------------------------
+void editorHandleSignals()
 {
-    if(at < 0 || at > row->size)
+    struct signalfd_siginfo si;
+
+    while(read(E.sigfd, &si, sizeof(si)) == sizeof(si))
     {
-        at = row->size;
+        switch(si.ssi_signo)
+        {
+            case SIGTERM:
+                // Unsaved edits stay in the journal
+                editorSaveFinish();
+                editorJournalCommit();
+                write(STDOUT_FILENO, "\x1b[2J", 4);
+                write(STDOUT_FILENO, "\x1b[H", 3);
+                exit(0);
+                break;
+
+            case SIGWINCH:
+                // A window being dragged sends a stream of these, so only
+                // the size after the first ATTO_RESIZE_DELAY ms is drawn
+                if(E.resize_time == 0)
+                    E.resize_time = editorNowMs() + ATTO_RESIZE_DELAY;
+                break;
+        }
     }
+}
+
+// ----------------------------------------------------------------
+// Time in ms until the status message has to be cleared, or -1 if
+// there is nothing to clear
+// ----------------------------------------------------------------
+int editorStatusTimeout()
+{
+    if(E.statusmsg[0] == '\0')
+        return -1;
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
 
-    editorUpdateRow(row);
-    ++E.dirty;
+    long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    long long left = (E.statusmsg_time + ATTO_STATUS_TIMEOUT) * 1000LL - now;
+
+    return left > 0 ? (int)left : -1;
+}
+
+// ----------------------------------------------------------------------
+// Sleep in `poll()` until something happens, then deal with it. Waits on
+// the terminal, signals and rows from the background loader at once, with
+// a timeout for the next timer, so nothing runs while the editor is idle.
+// ----------------------------------------------------------------------
+void editorWaitEvent()
+{
+    struct pollfd pfd[4];
+    int nfds = 0;
+
+    // Descriptors that are not in use are negative, which `poll()` skips
+    pfd[nfds++] = (struct pollfd){ STDIN_FILENO, POLLIN, 0 };
+    pfd[nfds++] = (struct pollfd){ E.sigfd, POLLIN, 0 };
+    pfd[nfds++] = (struct pollfd){ E.load.active ? E.load.wake[0] : -1, POLLIN, 0 };
+    pfd[nfds++] = (struct pollfd){ E.save.active ? E.save.wake[0] : -1, POLLIN, 0 };
+
+    // A sequence cut short only waits a little for the rest of it
+    int partial = E.input.pos < E.input.len;
+    int timeout = partial ? ATTO_ESC_TIMEOUT : editorStatusTimeout();
+
+    // A pending resize or journal commit may be due first
+    int timer = 0;
+    long long due[2] = { E.resize_time, E.journal.commit_time };
+    int i;
+    for(i = 0; i < 2; ++i)
+    {
+        if(due[i] == 0)
+            continue;
+
+        long long left = due[i] - editorNowMs();
+        if(left < 0)
+            left = 0;
+        if(timeout == -1 || left < timeout)
+        {
+            timeout = (int)left;
+            timer = 1;
+        }
+    }
+
+    int ready = poll(pfd, nfds, timeout);
+    if(ready == -1)
+    {
+        if(errno != EINTR && errno != EAGAIN)
+            die("poll");
+        return;
+    }
+
+    // Also checked when something else woke us, so that a steady stream
+    // of input cannot hold a resize back
+    if(E.resize_time && editorNowMs() >= E.resize_time)
+        editorResize();
+
+    if(E.journal.commit_time && editorNowMs() >= E.journal.commit_time)
+        editorJournalCommit();
+
+    if(ready == 0)
+    {
+        // The rest never came, so it was the escape key followed by
+        // other keys. Otherwise the status message has expired.
+        if(timer)
+            return;
+        else if(partial)
+            editorParseInput(1);
+        else
+            editorRefreshScreen();
+        return;
+    }
+
+    if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+        // Readable but empty means the terminal has gone away
+        if(editorFillInput() == 0)
+        {
+            errno = EIO;
+            die("read");
+        }
+    }
+
+    if(pfd[1].revents & POLLIN)
+        editorHandleSignals();
+
+    if(pfd[2].revents & POLLIN)
+    {
+        char buf[64];
+        while(read(E.load.wake[0], buf, sizeof(buf)) > 0)
+            ;
+
+        // Show rows loaded in the background while waiting for a key
+        if(editorLoadPoll(0))
+            editorRefreshScreen();
+    }
+
+    if(pfd[3].revents & POLLIN)
+    {
+        editorSaveFinish();
+        editorRefreshScreen();
+    }
+}
+
+// ----------------------------------------------------------------------
+// Write all `len` bytes to the terminal, carrying on after a short write
+// ----------------------------------------------------------------------
+void editorWriteAll(const char* s, int len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, s, len);
+        if(n == -1)
+        {
+            if(errno == EAGAIN)
+            {
+                struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+            }
+            else if(errno != EINTR)
+            {
+                die("write");
+            }
+            continue;
+        }
+
+        s += n;
+        len -= n;
+    }
+}
+
+// ----------------------------------------------------------------------
+// Wait for the next key. Input is read in chunks of up to ATTO_INPUT_BUF
+// bytes and parsed into a queue of keys, so a burst of input costs one
+// `read()` rather than one or more per key.
+// ----------------------------------------------------------------------
+int editorReadKey()
+{
+    struct inputState* in = &E.input;
+
+    while(in->khead == in->ktail)
+    {
+        editorParseInput(0);
+        if(in->khead != in->ktail)
+            break;
+
+        editorWaitEvent();
+    }
+
+    int key = in->keys[in->khead];
+    in->khead = (in->khead + 1) % ATTO_KEY_QUEUE;
+    return key;
+}
+
+// ------------------------------
+// Get Current Position of Cursor
+// ------------------------------
+int getCursorPosition(int* rows, int* cols)
+{
+    char buf[32];
+    unsigned int i = 0;
+
+    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+    {
+        return -1;
+    }
+
+    while(i < sizeof(buf) - 1)
+    {
+        // Reads do not wait in raw mode, so wait for the reply here
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if(poll(&pfd, 1, ATTO_ESC_TIMEOUT) != 1)
+        {
+            break;
+        }
+
+        if(read(STDIN_FILENO, &buf[i], 1) != 1)
+        {
+            break;
+        }
+
+        if(buf[i] == 'R')
+        {
+            break;
+        }
+
+        ++i;
+    }
+
+    buf[i] = '\0';
+
+    if(buf[0] != '\x1b' || buf[1] != '[')
+        return -1;
+    if(sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+        return -1;
+
+    return 0;
+}
+
+// ----------------------------
+// Get The Size of The Terminal
+// ----------------------------
+int getWindowSize(int* rows, int* cols)
+{
+    struct winsize ws;
+
+    // We can get the size of the terminal by simply calling ioctl()
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+        {
+            return -1;
+        }
+        return getCursorPosition(rows, cols);
+    }
+    else
+    {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+
+    }
+}
+
+// -------------------------------------------------------------------
+// Whether the terminal is known to support scroll regions (DECSTBM),
+// judging by `TERM`
+// -------------------------------------------------------------------
+int getScrollRegions()
+{
+    static const char* terms[] = {
+        "xterm", "screen", "tmux", "rxvt", "linux", "vt1", "vt2", "vt3",
+        "vt4", "vt5", "alacritty", "kitty", "foot", "st-", "wezterm",
+        "konsole", "gnome", "putty", "iterm"
+    };
+
+    const char* term = getenv("TERM");
+    if(term == NULL)
+        return 0;
+
+    unsigned int i;
+    for(i = 0; i < sizeof(terms) / sizeof(terms[0]); ++i)
+    {
+        if(strncmp(term, terms[i], strlen(terms[i])) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------
+// Whether the terminal supports synchronized output (mode 2026), asked
+// with DECRQM. A request for the device attributes (DA1) follows it, which
+// every terminal answers, so a terminal that does not know DECRQM does not
+// leave us waiting for a reply that never comes. Keys typed or pasted
+// while waiting are kept in `E.input` for the parser.
+// ----------------------------------------------------------------------
+int getSyncOutput()
+{
+    static const char query[] = "\x1b[?2026$p\x1b[c";
+    unsigned char buf[ATTO_INPUT_BUF];
+    int len = 0;
+    int pos = 0;        // Bytes of `buf` already sorted out
+    int sync = 0;
+    int done = 0;
+
+    if(write(STDOUT_FILENO, query, sizeof(query) - 1) != sizeof(query) - 1)
+        return 0;
+
+    // Read up to the end of the DA1 reply, `ESC [ ? ... c`
+    while(!done && len < (int)sizeof(buf))
+    {
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if(poll(&pfd, 1, ATTO_ESC_TIMEOUT) != 1)
+            break;
+
+        int n = read(STDIN_FILENO, &buf[len], sizeof(buf) - len);
+        if(n <= 0)
+            break;
+        len += n;
+
+        while(pos < len)
+        {
+            // Replies start with `ESC [ ?`, which no key does
+            int head = len - pos < 3 ? len - pos : 3;
+            if(memcmp(&buf[pos], "\x1b[?", head) != 0)
+            {
+                if(E.input.len < ATTO_INPUT_BUF)
+                    E.input.buf[E.input.len++] = buf[pos];
+                ++pos;
+                continue;
+            }
+
+            // Up to the final byte of the reply
+            int end = pos + head;
+            while(end < len && !(buf[end] >= 0x40 && buf[end] <= 0x7e))
+            {
+                ++end;
+            }
+            if(end == len)
+                break;
+
+            // The DECRQM reply is `ESC [ ? 2026 ; n $ y`, with `n` 1 (set)
+            // or 2 (reset) if the mode is supported
+            char reply[32];
+            int mode;
+            if(buf[end] == 'y' && end - pos < (int)sizeof(reply))
+            {
+                memcpy(reply, &buf[pos], end - pos + 1);
+                reply[end - pos + 1] = '\0';
+                sync = sscanf(reply, "\x1b[?2026;%d$y", &mode) == 1 && (mode == 1 || mode == 2);
+            }
+            else if(buf[end] == 'c')
+            {
+                done = 1;
+            }
+
+            pos = end + 1;
+        }
+    }
+
+    // Whatever was left over was not a reply after all
+    while(pos < len && E.input.len < ATTO_INPUT_BUF)
+    {
+        E.input.buf[E.input.len++] = buf[pos++];
+    }
+
+    return sync;
+}
+
+/*** Memory ***/
+
+// -----------------------------------------------------------
+// Size class of an allocation (ATTO_SLAB_CLASSES if too large)
+// -----------------------------------------------------------
+int arenaClass(size_t size)
+{
+    int c = 0;
+    size_t cs = (size_t)1 << ATTO_SLAB_MIN_SHIFT;
+
+    while(cs < size && c < ATTO_SLAB_CLASSES)
+    {
+        cs <<= 1;
+        ++c;
+    }
+
+    return c;
 }
 
 // ------------------------------------
-// Appends a string to the end of a row
+// Allocate `size` bytes for row storage
 // ------------------------------------
-void editorRowAppendString(erow* row, char* s, size_t len)
+void* arenaAlloc(size_t size)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    ++E.dirty;
+    struct arena* a = &E.tb.arena;
+    int c = arenaClass(size);
+    void* p;
+
+    ++a->stats.allocs;
+    a->stats.requested += size;
+
+    if(c == ATTO_SLAB_CLASSES)
+    {
+        // Too large for a slab, so it gets a block of its own
+        struct arenaBlock* blk = malloc(ARENA_HDR + size);
+        if(blk == NULL)
+            die("malloc");
+
+        blk->prev = NULL;
+        blk->next = a->large;
+        if(a->large)
+            a->large->prev = blk;
+        a->large = blk;
+
+        ++a->stats.sysallocs;
+        a->stats.used += size;
+        a->stats.reserved += ARENA_HDR + size;
+        return (char*)blk + ARENA_HDR;
+    }
+
+    size_t cs = (size_t)1 << (c + ATTO_SLAB_MIN_SHIFT);
+    a->stats.used += cs;
+
+    // Reuse a slab that was freed earlier
+    if(a->freelist[c])
+    {
+        p = a->freelist[c];
+        a->freelist[c] = *(void**)p;
+        ++a->stats.reused;
+        return p;
+    }
+
+    if(a->bumpleft < cs)
+    {
+        struct arenaBlock* chunk = malloc(ARENA_HDR + ATTO_ARENA_CHUNK);
+        if(chunk == NULL)
+            die("malloc");
+
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->bump = (char*)chunk + ARENA_HDR;
+        a->bumpleft = ATTO_ARENA_CHUNK;
+
+        ++a->stats.sysallocs;
+        a->stats.reserved += ARENA_HDR + ATTO_ARENA_CHUNK;
+    }
+
+    p = a->bump;
+    a->bump += cs;
+    a->bumpleft -= cs;
+    return p;
+}
+
+// -------------------------------------------------------------------
+// Give back an allocation of `size` bytes (the size it was asked with)
+// -------------------------------------------------------------------
+void arenaFree(void* p, size_t size)
+{
+    struct arena* a = &E.tb.arena;
+    int c = arenaClass(size);
+
+    if(p == NULL)
+        return;
+
+    ++a->stats.frees;
+    a->stats.requested -= size;
+
+    if(c == ATTO_SLAB_CLASSES)
+    {
+        struct arenaBlock* blk = (struct arenaBlock*)((char*)p - ARENA_HDR);
+
+        if(blk->prev)
+            blk->prev->next = blk->next;
+        else
+            a->large = blk->next;
+        if(blk->next)
+            blk->next->prev = blk->prev;
+
+        a->stats.used -= size;
+        a->stats.reserved -= ARENA_HDR + size;
+        free(blk);
+        return;
+    }
+
+    *(void**)p = a->freelist[c];
+    a->freelist[c] = p;
+    a->stats.used -= (size_t)1 << (c + ATTO_SLAB_MIN_SHIFT);
+}
+
+// ----------------------------------------------------------------------
+// Resize an allocation. Growing within the same size class costs nothing,
+// and growing by doubling moves to the next class up.
+// ----------------------------------------------------------------------
+void* arenaRealloc(void* p, size_t oldsize, size_t newsize)
+{
+    if(p != NULL && arenaClass(oldsize) == arenaClass(newsize) && arenaClass(newsize) < ATTO_SLAB_CLASSES)
+    {
+        E.tb.arena.stats.requested += newsize - oldsize;
+        return p;
+    }
+
+    void* q = arenaAlloc(newsize);
+    if(p != NULL)
+    {
+        memcpy(q, p, oldsize < newsize ? oldsize : newsize);
+        arenaFree(p, oldsize);
+    }
+
+    return q;
+}
+
+// -------------------------------------------------
+// Release every allocation of the arena in one go
+// -------------------------------------------------
+void arenaRelease()
+{
+    struct arena* a = &E.tb.arena;
+
+    while(a->chunks)
+    {
+        struct arenaBlock* next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+
+    while(a->large)
+    {
+        struct arenaBlock* next = a->large->next;
+        free(a->large);
+        a->large = next;
+    }
+
+    memset(a, 0, sizeof(*a));
+}
+
+/*** Text Buffer ***/
+
+// ----------------------------------------------------------
+// Copy text onto the end of the add buffer. The returned copy
+// never moves, so pieces can keep pointing at it.
+// ----------------------------------------------------------
+char* tbAppend(const char* s, int len)
+{
+    struct addBlock* blk = E.tb.add;
+
+    // Start a new block once the current one is full
+    if(blk == NULL || blk->cap - blk->len < len)
+    {
+        int cap = len > ATTO_ADD_BLOCK ? len : ATTO_ADD_BLOCK;
+
+        blk = arenaAlloc(sizeof(struct addBlock) + cap);
+        blk->next = E.tb.add;
+        blk->len = 0;
+        blk->cap = cap;
+        E.tb.add = blk;
+    }
+
+    char* p = &blk->data[blk->len];
+    memcpy(p, s, len);
+    blk->len += len;
+
+    return p;
+}
+
+// -----------------------------------
+// Get the array of pieces of an `erow`
+// -----------------------------------
+piece* tbRowPieces(erow* row)
+{
+    return row->piececap ? row->pieces : &row->inl;
+}
+
+// ------------------------------------------
+// Make room for at least `n` pieces in a row
+// ------------------------------------------
+void tbRowReserve(erow* row, int n)
+{
+    if(n <= row->piececap || (n <= 1 && row->piececap == 0))
+        return;
+
+    int cap = row->piececap ? row->piececap * 2 : 4;
+    while(cap < n)
+    {
+        cap *= 2;
+    }
+
+    if(row->piececap == 0)
+    {
+        // Move the inline piece into the arena
+        row->pieces = arenaAlloc(sizeof(piece) * cap);
+        if(row->npieces)
+            row->pieces[0] = row->inl;
+    }
+    else
+    {
+        row->pieces = arenaRealloc(row->pieces, sizeof(piece) * row->piececap, sizeof(piece) * cap);
+    }
+
+    row->piececap = cap;
+}
+
+// ---------------------------------------------------
+// Insert `n` pieces into a row before the piece `idx`
+// ---------------------------------------------------
+void tbRowSplice(erow* row, int idx, const piece* src, int n)
+{
+    if(n <= 0)
+        return;
+
+    tbRowReserve(row, row->npieces + n);
+
+    piece* p = tbRowPieces(row);
+    memmove(&p[idx + n], &p[idx], sizeof(piece) * (row->npieces - idx));
+    memcpy(&p[idx], src, sizeof(piece) * n);
+    row->npieces += n;
+}
+
+// ----------------------------------------------------------------
+// Find the piece holding the character at `at`. The offset of that
+// character inside the piece is stored in `off`. Returns `npieces`
+// when `at` is the end of the row.
+// ----------------------------------------------------------------
+int tbRowFind(erow* row, int at, int* off)
+{
+    piece* p = tbRowPieces(row);
+
+    int i;
+    for(i = 0; i < row->npieces; ++i)
+    {
+        if(at < p[i].len)
+            break;
+        at -= p[i].len;
+    }
+
+    *off = at;
+    return i;
+}
+
+// ------------------------------------------------------------------
+// Insert `len` bytes of text that are already in the text buffer into
+// a row at `at`
+// ------------------------------------------------------------------
+void tbRowInsertText(erow* row, int at, char* s, int len)
+{
+    if(len <= 0)
+        return;
+
+    int off;
+    int i = tbRowFind(row, at, &off);
+    piece* p = tbRowPieces(row);
+
+    if(off == 0 && i > 0 && p[i - 1].start + p[i - 1].len == s)
+    {
+        // Typing straight after the last text that was added only
+        // needs the piece to grow
+        p[i - 1].len += len;
+    }
+    else
+    {
+        piece added[2];
+        added[0].start = s;
+        added[0].len = len;
+
+        if(off == 0)
+        {
+            tbRowSplice(row, i, added, 1);
+        }
+        else
+        {
+            // Split the piece in two around the new text
+            added[1].start = p[i].start + off;
+            added[1].len = p[i].len - off;
+            p[i].len = off;
+            tbRowSplice(row, i + 1, added, 2);
+        }
+    }
+
+    row->size += len;
+}
+
+// ----------------------------------------------
+// Insert `len` bytes of text into a row at `at`
+// ----------------------------------------------
+void tbRowInsert(erow* row, int at, const char* s, int len)
+{
+    if(len <= 0)
+        return;
+
+    tbRowInsertText(row, at, tbAppend(s, len), len);
+}
+
+// ------------------------------------------------
+// Delete `len` bytes of text from a row, from `at`
+// ------------------------------------------------
+void tbRowDelete(erow* row, int at, int len)
+{
+    if(at < 0 || len <= 0 || at >= row->size)
+        return;
+
+    if(len > row->size - at)
+        len = row->size - at;
+
+    int off;
+    int i = tbRowFind(row, at, &off);
+    piece* p = tbRowPieces(row);
+
+    row->size -= len;
+
+    // Deleting from the middle of a single piece splits it in two
+    if(off > 0 && off + len < p[i].len)
+    {
+        piece right;
+        right.start = p[i].start + off + len;
+        right.len = p[i].len - off - len;
+        p[i].len = off;
+        tbRowSplice(row, i + 1, &right, 1);
+        return;
+    }
+
+    // Otherwise the deletion removes the tail of the first piece it
+    // touches, any pieces in between, and the head of the last one
+    if(off > 0)
+    {
+        len -= p[i].len - off;
+        p[i].len = off;
+        ++i;
+    }
+
+    int first = i;
+    while(len > 0 && len >= p[i].len)
+    {
+        len -= p[i].len;
+        ++i;
+    }
+
+    if(len > 0)
+    {
+        p[i].start += len;
+        p[i].len -= len;
+    }
+
+    memmove(&p[first], &p[i], sizeof(piece) * (row->npieces - i));
+    row->npieces -= i - first;
+}
+
+// -------------------------------------------------------------------
+// Move the text of `row` from `at` onwards to the end of the row `dst`
+// -------------------------------------------------------------------
+void tbRowSplit(erow* row, int at, erow* dst)
+{
+    int off;
+    int i = tbRowFind(row, at, &off);
+    piece* p = tbRowPieces(row);
+
+    if(off > 0)
+    {
+        piece right;
+        right.start = p[i].start + off;
+        right.len = p[i].len - off;
+        p[i].len = off;
+        tbRowSplice(dst, dst->npieces, &right, 1);
+        ++i;
+    }
+
+    tbRowSplice(dst, dst->npieces, &p[i], row->npieces - i);
+    dst->size += row->size - at;
+
+    row->npieces = i;
+    row->size = at;
+}
+
+// ---------------------------------------------
+// Append the text of `src` to the end of `row`
+// ---------------------------------------------
+void tbRowAppend(erow* row, erow* src)
+{
+    piece* p = tbRowPieces(row);
+    piece* s = tbRowPieces(src);
+    int n = src->npieces;
+
+    // Rejoining text that was split apart gives back a single piece
+    if(row->npieces && n && p[row->npieces - 1].start + p[row->npieces - 1].len == s[0].start)
+    {
+        p[row->npieces - 1].len += s[0].len;
+        ++s;
+        --n;
+    }
+
+    tbRowSplice(row, row->npieces, s, n);
+    row->size += src->size;
+}
+
+// ----------------------------------------------------------
+// Copy the text of a row into `dst`, which holds `size` bytes
+// ----------------------------------------------------------
+void tbRowCopy(erow* row, char* dst)
+{
+    piece* p = tbRowPieces(row);
+
+    int i;
+    for(i = 0; i < row->npieces; ++i)
+    {
+        memcpy(dst, p[i].start, p[i].len);
+        dst += p[i].len;
+    }
+}
+
+// -----------------------------------
+// Free the pieces array owned by a row
+// -----------------------------------
+void tbRowFree(erow* row)
+{
+    if(row->piececap)
+        arenaFree(row->pieces, sizeof(piece) * row->piececap);
+}
+
+// ----------------------------------------------------------------------
+// SIGBUS handler. Reading a page of the mapped file past its end, once
+// it was cut short on disk, raises SIGBUS in whichever thread does it.
+// That page and all those after it are replaced with zeros and the read
+// carries on, to be dealt with by `tbDetachFile()`. Any other SIGBUS is
+// fatal as usual.
+// ----------------------------------------------------------------------
+void tbBusHandler(int sig, siginfo_t* si, void* ctx)
+{
+    (void)ctx;
+
+    char* addr = si->si_addr;
+    if(E.tb.mapped && addr >= E.tb.orig && addr < E.tb.orig + E.tb.origlen)
+    {
+        char* page = (char*)((uintptr_t)addr & ~(uintptr_t)(E.tb.pagesize - 1));
+        size_t len = E.tb.orig + E.tb.origlen - page;
+        if(mmap(page, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+        {
+            E.tb.cut = 1;
+            return;
+        }
+    }
+
+    signal(sig, SIG_DFL);
+}
+
+// ----------------------------------------------------------------------
+// Turn the mapping of a file cut short on disk into a private copy, in
+// place, so rows keep pointing at the same text and later changes to the
+// file can't reach it. Whatever was cut off is gone and reads as zeros,
+// which don't show.
+// ----------------------------------------------------------------------
+void tbDetachFile()
+{
+    E.tb.cut = 0;
+    if(!E.tb.mapped)
+        return;
+
+    if(mprotect(E.tb.orig, E.tb.origlen, PROT_READ | PROT_WRITE) == -1)
+        die("mprotect");
+
+    // Writing to a page of a private mapping copies it
+    size_t off;
+    for(off = 0; off < E.tb.origlen; off += E.tb.pagesize)
+    {
+        volatile char* p = E.tb.orig + off;
+        *p = *p;
+    }
+
+    mprotect(E.tb.orig, E.tb.origlen, PROT_READ);
+    E.tb.mapped = 0;
+
+    editorSetStatusMessage("%s was cut short on disk, the text it lost is blank", E.filename);
+}
+
+/*** Line Scanning ***/
+
+// ---------------------------------------------------------------
+// Offset array entry for the line break at `at` in the block `p`
+// ---------------------------------------------------------------
+uint32_t tbScanEntry(const char* p, size_t at)
+{
+    return at | ((at > 0 && p[at - 1] == '\r') ? ATTO_CRLF : 0);
+}
+
+// ----------------------------------------------------------------
+// Scan the bytes of `p` from `i` to `len` one at a time, adding the
+// line breaks found to the `n` already in `offs`
+// ----------------------------------------------------------------
+int tbScanTail(const char* p, size_t i, size_t len, uint32_t* offs, int n, int max, size_t* done)
+{
+    for(; i < len && n < max; ++i)
+    {
+        if(p[i] == '\n')
+            offs[n++] = tbScanEntry(p, i);
+    }
+
+    *done = i;
+    return n;
+}
+
+// --------------------------------------------------------------------
+// Find the line breaks in the `len` bytes at `p`, one byte at a time.
+// The offset of each '\n' goes into `offs`, stopping after `max` of
+// them. `done` is set to the number of bytes consumed.
+// --------------------------------------------------------------------
+int tbScanLinesScalar(const char* p, size_t len, uint32_t* offs, int max, size_t* done)
+{
+    return tbScanTail(p, 0, len, offs, 0, max, done);
+}
+
+#ifdef ATTO_SCAN_SIMD
+
+// -------------------------------------------------------
+// Same as `tbScanLinesScalar()`, comparing 16 bytes at once
+// -------------------------------------------------------
+__attribute__((target("sse2")))
+int tbScanLinesSse2(const char* p, size_t len, uint32_t* offs, int max, size_t* done)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    int n = 0;
+
+    size_t i;
+    for(i = 0; i + 16 <= len; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&p[i]), nl));
+
+        // Each set bit is a line break
+        while(mask)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            offs[n++] = tbScanEntry(p, at);
+            if(n == max)
+            {
+                *done = at + 1;
+                return n;
+            }
+        }
+    }
+
+    // Finish the last few bytes one at a time
+    return tbScanTail(p, i, len, offs, n, max, done);
+}
+
+// -------------------------------------------------------
+// Same as `tbScanLinesScalar()`, comparing 32 bytes at once
+// -------------------------------------------------------
+__attribute__((target("avx2")))
+int tbScanLinesAvx2(const char* p, size_t len, uint32_t* offs, int max, size_t* done)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    int n = 0;
+
+    size_t i;
+    for(i = 0; i + 32 <= len; i += 32)
+    {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&p[i]), nl));
+
+        while(mask)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            offs[n++] = tbScanEntry(p, at);
+            if(n == max)
+            {
+                *done = at + 1;
+                return n;
+            }
+        }
+    }
+
+    return tbScanTail(p, i, len, offs, n, max, done);
+}
+
+#endif
+
+// Scanner picked for this CPU by `tbScanInit()`
+int (*tbScanLines)(const char* p, size_t len, uint32_t* offs, int max, size_t* done) = tbScanLinesScalar;
+
+// -------------------------------------------------
+// Pick the fastest newline scanner the CPU supports
+// -------------------------------------------------
+void tbScanInit()
+{
+#ifdef ATTO_SCAN_SIMD
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+        tbScanLines = tbScanLinesAvx2;
+    else if(__builtin_cpu_supports("sse2"))
+        tbScanLines = tbScanLinesSse2;
+#endif
+}
+
+/*** Row Store ***/
+
+// -------------------------------
+// Allocate an empty row store node
+// -------------------------------
+rowNode* rsNewLeaf()
+{
+    rowNode* node = arenaAlloc(sizeof(rowLeaf));
+    node->leaf = LEAF_ROWS;
+    node->n = 0;
+    return node;
+}
+
+rowNode* rsNewInner()
+{
+    rowNode* node = arenaAlloc(sizeof(rowInner));
+    node->leaf = 0;
+    node->n = 0;
+    return node;
+}
+
+void rsFreeNode(rowNode* node)
+{
+    if(node->leaf == LEAF_LAZY)
+        arenaFree(node, sizeof(rowLazy));
+    else
+        arenaFree(node, node->leaf ? sizeof(rowLeaf) : sizeof(rowInner));
+}
+
+// ----------------------------------------------------------------------
+// Split the rows of a leaf that was not built yet into `rows`. A file cut
+// short on disk since it was counted may hold fewer lines, and the rows
+// missing are left empty.
+// ----------------------------------------------------------------------
+void rsSplitLazy(rowLazy* lazy, erow* rows)
+{
+    size_t used;
+    int n = editorSplitRows(E.tb.orig + lazy->start, lazy->len, 1, rows, lazy->hdr.n, &used);
+
+    while(n < lazy->hdr.n)
+    {
+        editorMakeRow(&rows[n++], NULL, 0);
+    }
+}
+
+// ---------------------------------------------------------------
+// Get the child `i` of an inner node, building its rows first if it
+// is a leaf whose rows were not built yet
+// ---------------------------------------------------------------
+rowNode* rsChild(rowInner* in, int i)
+{
+    rowNode* child = in->child[i];
+    if(child->leaf != LEAF_LAZY)
+        return child;
+
+    rowNode* leaf = rsNewLeaf();
+    rsSplitLazy((rowLazy*)child, ((rowLeaf*)leaf)->rows);
+    leaf->n = child->n;
+
+    rsFreeNode(child);
+    in->child[i] = leaf;
+    return leaf;
+}
+
+// -----------------------------------------
+// Number of rows below a node of the store
+// -----------------------------------------
+int rsCount(rowNode* node)
+{
+    if(node->leaf)
+        return node->n;
+
+    int count = 0;
+    int i;
+    for(i = 0; i < node->n; ++i)
+    {
+        count += ((rowInner*)node)->count[i];
+    }
+    return count;
+}
+
+// ---------------------------------------------------------------
+// Add a child to an inner node that has room for it, before `idx`
+// ---------------------------------------------------------------
+void rsInnerAdd(rowInner* in, int idx, rowNode* child, int count)
+{
+    memmove(&in->child[idx + 1], &in->child[idx], sizeof(rowNode*) * (in->hdr.n - idx));
+    memmove(&in->count[idx + 1], &in->count[idx], sizeof(int) * (in->hdr.n - idx));
+    in->child[idx] = child;
+    in->count[idx] = count;
+    ++in->hdr.n;
+}
+
+// ----------------------------------------------------------------
+// Remove the child `idx` of an inner node (without freeing the child)
+// ----------------------------------------------------------------
+void rsInnerRemove(rowInner* in, int idx)
+{
+    memmove(&in->child[idx], &in->child[idx + 1], sizeof(rowNode*) * (in->hdr.n - idx - 1));
+    memmove(&in->count[idx], &in->count[idx + 1], sizeof(int) * (in->hdr.n - idx - 1));
+    --in->hdr.n;
+}
+
+// ---------------------------------------------------------------------
+// Insert a row below `node` at index `at`. When the node has to be split
+// the new right half is returned, otherwise NULL.
+// ---------------------------------------------------------------------
+rowNode* rsInsert(rowNode* node, int at, erow* row)
+{
+    if(node->leaf)
+    {
+        rowLeaf* leaf = (rowLeaf*)node;
+
+        if(node->n < ATTO_LEAF_ROWS)
+        {
+            memmove(&leaf->rows[at + 1], &leaf->rows[at], sizeof(erow) * (node->n - at));
+            leaf->rows[at] = *row;
+            ++node->n;
+            return NULL;
+        }
+
+        // Split the full leaf. Appending to the end starts an empty leaf
+        // instead, so loading a file row by row leaves every leaf full.
+        rowNode* right = rsNewLeaf();
+        int half = (at == node->n) ? node->n : node->n / 2;
+
+        memcpy(((rowLeaf*)right)->rows, &leaf->rows[half], sizeof(erow) * (node->n - half));
+        right->n = node->n - half;
+        node->n = half;
+
+        if(at <= half && at < ATTO_LEAF_ROWS)
+            rsInsert(node, at, row);
+        else
+            rsInsert(right, at - half, row);
+
+        return right;
+    }
+
+    rowInner* in = (rowInner*)node;
+
+    // Find the child to insert into
+    int i;
+    for(i = 0; i < node->n - 1 && at > in->count[i]; ++i)
+    {
+        at -= in->count[i];
+    }
+
+    rowNode* sib = rsInsert(rsChild(in, i), at, row);
+    ++in->count[i];
+
+    if(sib == NULL)
+        return NULL;
+
+    // The child was split, so its new sibling goes right after it
+    int total = in->count[i];
+    in->count[i] = rsCount(in->child[i]);
+
+    if(node->n < ATTO_INNER_NODES)
+    {
+        rsInnerAdd(in, i + 1, sib, total - in->count[i]);
+        return NULL;
+    }
+
+    rowInner* right = (rowInner*)rsNewInner();
+    int half = (i + 1 == node->n) ? node->n : node->n / 2;
+
+    memcpy(right->child, &in->child[half], sizeof(rowNode*) * (node->n - half));
+    memcpy(right->count, &in->count[half], sizeof(int) * (node->n - half));
+    right->hdr.n = node->n - half;
+    node->n = half;
+
+    if(i + 1 <= half && half < ATTO_INNER_NODES)
+        rsInnerAdd(in, i + 1, sib, total - in->count[i]);
+    else
+        rsInnerAdd(right, i + 1 - half, sib, total - in->count[i]);
+
+    return &right->hdr;
+}
+
+// ----------------------------------------------------------------------
+// Merge two neighbouring children of an inner node when they fit in one
+// ----------------------------------------------------------------------
+void rsMerge(rowInner* in, int i)
+{
+    rowNode* left = in->child[i];
+    rowNode* right = in->child[i + 1];
+    int cap = left->leaf ? ATTO_LEAF_ROWS : ATTO_INNER_NODES;
+
+    // Leaves that were never looked at are left as they are
+    if(left->n + right->n > cap || left->leaf == LEAF_LAZY || right->leaf == LEAF_LAZY)
+        return;
+
+    if(left->leaf)
+    {
+        memcpy(&((rowLeaf*)left)->rows[left->n], ((rowLeaf*)right)->rows, sizeof(erow) * right->n);
+    }
+    else
+    {
+        memcpy(&((rowInner*)left)->child[left->n], ((rowInner*)right)->child, sizeof(rowNode*) * right->n);
+        memcpy(&((rowInner*)left)->count[left->n], ((rowInner*)right)->count, sizeof(int) * right->n);
+    }
+
+    left->n += right->n;
+    in->count[i] += in->count[i + 1];
+    rsInnerRemove(in, i + 1);
+    rsFreeNode(right);
+}
+
+// ---------------------------------------------------------------
+// Remove the row at index `at` below `node`. The row's memory must
+// already have been released.
+// ---------------------------------------------------------------
+void rsDelete(rowNode* node, int at)
+{
+    if(node->leaf)
+    {
+        rowLeaf* leaf = (rowLeaf*)node;
+        memmove(&leaf->rows[at], &leaf->rows[at + 1], sizeof(erow) * (node->n - at - 1));
+        --node->n;
+        return;
+    }
+
+    rowInner* in = (rowInner*)node;
+
+    int i;
+    for(i = 0; at >= in->count[i]; ++i)
+    {
+        at -= in->count[i];
+    }
+
+    rowNode* child = rsChild(in, i);
+    rsDelete(child, at);
+    --in->count[i];
+
+    if(in->count[i] == 0)
+    {
+        rsInnerRemove(in, i);
+        rsFreeNode(child);
+    }
+    else if(node->n > 1 && child->n < (child->leaf ? ATTO_LEAF_ROWS : ATTO_INNER_NODES) / 4)
+    {
+        // Keep nodes from becoming sparse as rows are deleted
+        rsMerge(in, i + 1 < node->n ? i : i - 1);
+    }
+}
+
+// ----------------------------------------------------------------------
+// Find the leaf holding the row at index `*at`, and set `*at` to the
+// index of the row inside it. Leaves whose rows were not built yet are
+// built on the way, unless `peek` is set.
+// ----------------------------------------------------------------------
+rowNode* rsFindLeaf(int* at, int peek)
+{
+    rowNode* node = E.rows;
+
+    while(!node->leaf)
+    {
+        rowInner* in = (rowInner*)node;
+
+        int i;
+        for(i = 0; *at >= in->count[i]; ++i)
+        {
+            *at -= in->count[i];
+        }
+        node = peek ? in->child[i] : rsChild(in, i);
+    }
+
+    return node;
+}
+
+// --------------------------------------------------------
+// Get the row at index `at`. The pointer stays valid until
+// the next row is inserted or deleted.
+// --------------------------------------------------------
+erow* editorRowAt(int at)
+{
+    rowNode* node = rsFindLeaf(&at, 0);
+    return &((rowLeaf*)node)->rows[at];
+}
+
+// ---------------------------------------------------------------
+// Get the row at index `at` along with the rows after it in the
+// same leaf. `n` is set to the number of rows returned.
+// ---------------------------------------------------------------
+erow* rsRowsAt(int at, int* n)
+{
+    rowNode* node = rsFindLeaf(&at, 0);
+
+    *n = node->n - at;
+    return &((rowLeaf*)node)->rows[at];
+}
+
+// ----------------------------------------------------------------------
+// Like `rsRowsAt()`, but the rows of a leaf that were not built yet are
+// only split into `tmp`, which holds ATTO_LEAF_ROWS rows, and are not
+// kept. For reading through the whole file without building it all.
+// ----------------------------------------------------------------------
+erow* rsPeekRows(int at, int* n, erow* tmp)
+{
+    rowNode* node = rsFindLeaf(&at, 1);
+    erow* rows = ((rowLeaf*)node)->rows;
+
+    if(node->leaf == LEAF_LAZY)
+    {
+        rsSplitLazy((rowLazy*)node, tmp);
+        rows = tmp;
+    }
+
+    *n = node->n - at;
+    return &rows[at];
+}
+
+// -------------------------------------------
+// Insert a row into the store at index `at`
+// -------------------------------------------
+void rsInsertRow(int at, erow* row)
+{
+    rowNode* sib = rsInsert(E.rows, at, row);
+
+    // The root was split, so the tree grows by one level
+    if(sib != NULL)
+    {
+        rowInner* root = (rowInner*)rsNewInner();
+        int count = E.numrows + 1 - rsCount(sib);
+
+        rsInnerAdd(root, 0, E.rows, count);
+        rsInnerAdd(root, 1, sib, E.numrows + 1 - count);
+        E.rows = &root->hdr;
+    }
+
+    ++E.numrows;
+}
+
+// -------------------------------------------------------------
+// Append `n` rows to the end of the store, filling the last leaf
+// directly instead of walking down the tree for every row
+// -------------------------------------------------------------
+void rsAppendRows(erow* rows, int n)
+{
+    while(n > 0)
+    {
+        rowNode* node = E.rows;
+        while(!node->leaf)
+        {
+            node = rsChild((rowInner*)node, node->n - 1);
+        }
+
+        // A full leaf gets a new empty sibling from a normal insert
+        int room = ATTO_LEAF_ROWS - node->n;
+        if(room == 0)
+        {
+            rsInsertRow(E.numrows, rows);
+            ++rows;
+            --n;
+            continue;
+        }
+
+        int k = n < room ? n : room;
+
+        rowNode* up = E.rows;
+        while(!up->leaf)
+        {
+            ((rowInner*)up)->count[up->n - 1] += k;
+            up = ((rowInner*)up)->child[up->n - 1];
+        }
+
+        memcpy(&((rowLeaf*)node)->rows[node->n], rows, sizeof(erow) * k);
+        node->n += k;
+        E.numrows += k;
+
+        rows += k;
+        n -= k;
+    }
+}
+
+// ----------------------------------------------------------------------
+// Append the leaf `leaf` after the last one below the inner node `node`.
+// When the node is full a new right sibling is started and returned,
+// otherwise NULL, so appending leaves them all full.
+// ----------------------------------------------------------------------
+rowNode* rsAppendNode(rowNode* node, rowNode* leaf)
+{
+    rowInner* in = (rowInner*)node;
+    int i = node->n - 1;
+    rowNode* sib = leaf;
+
+    if(!in->child[i]->leaf)
+    {
+        sib = rsAppendNode(in->child[i], leaf);
+        in->count[i] += leaf->n;
+        if(sib == NULL)
+            return NULL;
+
+        in->count[i] -= rsCount(sib);
+    }
+
+    if(node->n < ATTO_INNER_NODES)
+    {
+        rsInnerAdd(in, node->n, sib, rsCount(sib));
+        return NULL;
+    }
+
+    rowInner* right = (rowInner*)rsNewInner();
+    rsInnerAdd(right, 0, sib, rsCount(sib));
+    return &right->hdr;
+}
+
+// ----------------------------------------------------------------
+// Append a whole leaf of rows to the end of the store, such as one
+// whose rows are not built yet from the background loader
+// ----------------------------------------------------------------
+void rsAppendLeaf(rowNode* leaf)
+{
+    rowNode* sib = E.rows->leaf ? leaf : rsAppendNode(E.rows, leaf);
+
+    // The root was split, so the tree grows by one level
+    if(sib != NULL)
+    {
+        rowInner* root = (rowInner*)rsNewInner();
+        rsInnerAdd(root, 0, E.rows, E.numrows);
+        rsInnerAdd(root, 1, sib, rsCount(sib));
+        E.rows = &root->hdr;
+    }
+
+    E.numrows += leaf->n;
+}
+
+// -----------------------------------------
+// Remove the row at index `at` from the store
+// -----------------------------------------
+void rsDeleteRow(int at)
+{
+    rsDelete(E.rows, at);
+    --E.numrows;
+
+    // Drop levels that are left with a single child
+    while(!E.rows->leaf && E.rows->n <= 1)
+    {
+        rowNode* old = E.rows;
+        E.rows = old->n ? rsChild((rowInner*)old, 0) : rsNewLeaf();
+        rsFreeNode(old);
+    }
+}
+
+/*** Row Operations ***/
+
+// ------------------------------------------------------------------
+// Mark the `render` string of a row as out of date after its text has
+// changed. It is only rebuilt once the row is drawn again.
+// ------------------------------------------------------------------
+void editorUpdateRow(erow* row)
+{
+    row->flags |= ROW_STALE;
+}
+
+// --------------------------------------------
+// Header of the owned render string of a row
+// --------------------------------------------
+struct rowGap* editorRowGap(erow* row)
+{
+    return (struct rowGap*)(row->render - offsetof(struct rowGap, text));
+}
+
+// ----------------------------------------
+// Free the render string owned by a row
+// ----------------------------------------
+void editorFreeRender(erow* row)
+{
+    if(row->flags & ROW_GAP)
+    {
+        struct rowGap* g = editorRowGap(row);
+        arenaFree(g->tabs, sizeof(struct tabStop) * g->tabcap);
+        arenaFree(g, sizeof(struct rowGap) + g->cap);
+    }
+
+    row->flags &= ~ROW_GAP;
+    row->render = NULL;
+}
+
+// ------------------------------------------------
+// Move the gap of an owned render string to `at`
+// ------------------------------------------------
+void editorRowMoveGap(erow* row, int at)
+{
+    int gaplen = editorRowGap(row)->cap - row->rsize;
+
+    if(at < row->gap)
+        memmove(&row->render[at + gaplen], &row->render[at], row->gap - at);
+    else if(at > row->gap)
+        memmove(&row->render[row->gap], &row->render[row->gap + gaplen], at - row->gap);
+
+    row->gap = at;
+}
+
+// -------------------------------------------------------------
+// Insert `len` bytes into an owned render string at `at`. The
+// gap is doubled when it runs out, so inserts are O(1) amortised.
+// -------------------------------------------------------------
+void editorRenderInsert(erow* row, int at, const char* s, int len)
+{
+    struct rowGap* g = editorRowGap(row);
+
+    if(g->cap - row->rsize < len)
+    {
+        int cap = (g->cap + len) * 2;
+        struct rowGap* ng = arenaAlloc(sizeof(struct rowGap) + cap);
+        int after = row->rsize - at;
+
+        // Copy the text around the new gap directly into place
+        editorRowMoveGap(row, row->rsize);
+        memcpy(ng->text, g->text, at);
+        memcpy(&ng->text[cap - after], &g->text[at], after);
+
+        *ng = *g;
+        ng->cap = cap;
+        arenaFree(g, sizeof(struct rowGap) + g->cap);
+
+        g = ng;
+        row->render = g->text;
+        row->gap = at;
+    }
+    else
+    {
+        editorRowMoveGap(row, at);
+    }
+
+    memcpy(&row->render[row->gap], s, len);
+    row->gap += len;
+    row->rsize += len;
+}
+
+// ---------------------------------------------------------
+// Remove `len` bytes from an owned render string at `at`
+// ---------------------------------------------------------
+void editorRenderDelete(erow* row, int at, int len)
+{
+    editorRowMoveGap(row, at);
+    row->rsize -= len;
+}
+
+// ----------------------------------------------------------------------
+// Tab `k` of a row with an owned render string. Like the render string,
+// the tab index has a gap at the last edit. Tabs after the gap are stored
+// counting back from the end of the row, so edits before them leave them
+// untouched.
+// ----------------------------------------------------------------------
+struct tabStop editorRowTab(erow* row, int k)
+{
+    struct rowGap* g = editorRowGap(row);
+
+    if(k < g->tabgap)
+        return g->tabs[k];
+
+    struct tabStop t = g->tabs[k + g->tabcap - g->ntabs];
+    t.cx = row->size - t.cx;
+    t.rx = row->rsize - t.rx;
+    return t;
+}
+
+// -------------------------------------------------
+// Number of tabs before text index `cx` of a row
+// -------------------------------------------------
+int editorRowTabsBefore(erow* row, int cx)
+{
+    int lo = 0;
+    int hi = editorRowGap(row)->ntabs;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if(editorRowTab(row, mid).cx < cx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// --------------------------------------------------------------
+// Move the gap of the tab index of a row to just before tab `k`
+// --------------------------------------------------------------
+void editorRowMoveTabGap(erow* row, int k)
+{
+    struct rowGap* g = editorRowGap(row);
+    int gaplen = g->tabcap - g->ntabs;
+    struct tabStop t;
+
+    while(g->tabgap > k)
+    {
+        t = g->tabs[--g->tabgap];
+        g->tabs[g->tabgap + gaplen].cx = row->size - t.cx;
+        g->tabs[g->tabgap + gaplen].rx = row->rsize - t.rx;
+    }
+
+    while(g->tabgap < k)
+    {
+        t = g->tabs[g->tabgap + gaplen];
+        g->tabs[g->tabgap].cx = row->size - t.cx;
+        g->tabs[g->tabgap].rx = row->rsize - t.rx;
+        ++g->tabgap;
+    }
+}
+
+// ---------------------------------------------------------------------
+// Add a tab at the gap of the tab index, which must be where it belongs
+// ---------------------------------------------------------------------
+void editorRowAddTab(erow* row, int cx, int rx)
+{
+    struct rowGap* g = editorRowGap(row);
+
+    if(g->ntabs == g->tabcap)
+    {
+        int cap = g->tabcap ? g->tabcap * 2 : 4;
+        int after = g->ntabs - g->tabgap;
+        struct tabStop* tabs = arenaAlloc(sizeof(struct tabStop) * cap);
+
+        // The first tab of a row has no index to copy yet
+        if(g->tabs)
+        {
+            memcpy(tabs, g->tabs, sizeof(struct tabStop) * g->tabgap);
+            memcpy(&tabs[cap - after], &g->tabs[g->tabgap], sizeof(struct tabStop) * after);
+            arenaFree(g->tabs, sizeof(struct tabStop) * g->tabcap);
+        }
+
+        g->tabs = tabs;
+        g->tabcap = cap;
+    }
+
+    g->tabs[g->tabgap].cx = cx;
+    g->tabs[g->tabgap].rx = rx;
+    ++g->tabgap;
+    ++g->ntabs;
+}
+
+// ----------------------------------------------------------------------
+// After an edit moved the text from text index `cx` (now at render index
+// `rx`) by `shift` columns, patch the render string up to the next tab.
+// That tab grows or shrinks to reach its tab stop, so everything after it
+// stays where it was, or moves by whole tab stops. The gaps of the render
+// string and of the tab index must be at the edit, and the render string's
+// is left at `rx`.
+// ----------------------------------------------------------------------
+void editorRenderRealign(erow* row, int cx, int rx, int shift)
+{
+    struct rowGap* g = editorRowGap(row);
+
+    if(shift % ATTO_TAB_STOP != 0 && g->tabgap < g->ntabs)
+    {
+        int tab = editorRowTab(row, g->tabgap).cx;
+        int trx = rx + (tab - cx);
+        int oldw = ATTO_TAB_STOP - (trx - shift) % ATTO_TAB_STOP;
+        int neww = ATTO_TAB_STOP - trx % ATTO_TAB_STOP;
+
+        if(neww > oldw)
+        {
+            char spaces[ATTO_TAB_STOP];
+            memset(spaces, ' ', sizeof(spaces));
+            editorRenderInsert(row, trx + oldw, spaces, neww - oldw);
+        }
+        else
+        {
+            editorRenderDelete(row, trx + neww, oldw - neww);
+        }
+    }
+
+    editorRowMoveGap(row, rx);
+}
+
+// ----------------------------------------------------------------------
+// Uses the pieces of text of an `erow` to fill in the `render` string, if
+// it is out of date. Rows without tabs that are a single piece of text
+// render exactly as they are stored, so `render` just points at the text.
+// Other rows get a render string of their own with a gap at the end,
+// ready for the next edit.
+// ----------------------------------------------------------------------
+void editorRenderRow(erow* row)
+{
+    if(!(row->flags & ROW_STALE))
+        return;
+
+    int tabs = 0;
+    int need = 0;   // Exact length of the render string
+    piece* p = tbRowPieces(row);
+
+    int i, j;
+    for(i = 0; i < row->npieces; ++i)
+    {
+        for(j = 0; j < p[i].len; ++j)
+        {
+            if(p[i].start[j] == '\t')
+            {
+                ++tabs;
+                need += ATTO_TAB_STOP - need % ATTO_TAB_STOP;
+            }
+            else
+            {
+                ++need;
+            }
+        }
+    }
+
+    row->flags &= ~ROW_STALE;
+
+    if(tabs == 0 && row->npieces <= 1)
+    {
+        editorFreeRender(row);
+        row->render = row->npieces ? p[0].start : "";
+        row->rsize = row->size;
+        return;
+    }
+
+    // Keep the current render string unless it is too small, or much too
+    // large after the row shrank
+    struct rowGap* g = (row->flags & ROW_GAP) ? editorRowGap(row) : NULL;
+    if(g == NULL || g->cap < need || g->cap > 2 * need + 2 * ATTO_GAP_MIN)
+    {
+        int cap = need + need / 8 + ATTO_GAP_MIN;
+
+        editorFreeRender(row);
+        g = arenaAlloc(sizeof(struct rowGap) + cap);
+        g->cap = cap;
+        g->tabs = NULL;
+        g->tabcap = 0;
+        row->render = g->text;
+        row->flags |= ROW_GAP;
+    }
+
+    if(g->tabcap < tabs)
+    {
+        arenaFree(g->tabs, sizeof(struct tabStop) * g->tabcap);
+        g->tabcap = tabs + tabs / 8 + 4;
+        g->tabs = arenaAlloc(sizeof(struct tabStop) * g->tabcap);
+    }
+
+    int idx = 0;
+    int cx = 0;
+    tabs = 0;
+    for(i = 0; i < row->npieces; ++i)
+    {
+        for(j = 0; j < p[i].len; ++j, ++cx)
+        {
+            if(p[i].start[j] == '\t')
+            {
+                // Render tabs as 4 spaces
+                row->render[idx++] = ' ';
+                while(idx % ATTO_TAB_STOP != 0)
+                {
+                    row->render[idx++] = ' ';
+                }
+
+                g->tabs[tabs].cx = cx;
+                g->tabs[tabs].rx = idx;
+                ++tabs;
+            }
+            else
+            {
+                row->render[idx++] = p[i].start[j];
+            }
+        }
+    }
+
+    g->ntabs = tabs;
+    g->tabgap = tabs;
+    row->rsize = idx;
+    row->gap = idx;
+}
+
+// -------------------------------------------
+// Convert a text index into a `render` index
+// -------------------------------------------
+int editorRowCxToRx(erow* row, int cx)
+{
+    editorRenderRow(row);
+
+    // PAGE UP and PAGE DOWN move onto a row before snapping `cx` to it
+    if(cx > row->size)
+        cx = row->size;
+
+    // Rows without a render string of their own have no tabs
+    if(!(row->flags & ROW_GAP))
+        return cx;
+
+    // Count on from the last tab before `cx`
+    int k = editorRowTabsBefore(row, cx);
+    if(k == 0)
+        return cx;
+
+    struct tabStop t = editorRowTab(row, k - 1);
+    return t.rx + (cx - t.cx - 1);
+}
+
+// --------------------------------------------------------------------
+// Convert a `render` index into a text index. Columns inside a tab give
+// the index of the tab.
+// --------------------------------------------------------------------
+int editorRowRxToCx(erow* row, int rx)
+{
+    editorRenderRow(row);
+
+    int cx = rx;
+
+    if(row->flags & ROW_GAP)
+    {
+        // Find the last tab ending at or before `rx`, and count on from it
+        int lo = 0;
+        int hi = editorRowGap(row)->ntabs;
+
+        while(lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+
+            if(editorRowTab(row, mid).rx <= rx)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if(lo > 0)
+        {
+            struct tabStop t = editorRowTab(row, lo - 1);
+            cx = t.cx + 1 + (rx - t.rx);
+        }
+
+        if(lo < editorRowGap(row)->ntabs && cx > editorRowTab(row, lo).cx)
+            cx = editorRowTab(row, lo).cx;
+    }
+
+    if(cx > row->size)
+        cx = row->size;
+
+    return cx;
+}
+
+// -----------------------------------------------------------------
+// Fill in a new `erow` for `len` bytes of text at `s`. `s` must point
+// into the text buffer; the row refers to it directly.
+// -----------------------------------------------------------------
+void editorMakeRow(erow* row, char* s, size_t len)
+{
+    row->size = len;
+    row->npieces = len ? 1 : 0;
+    row->piececap = 0;
+    row->pieces = NULL;
+    row->inl.start = s;
+    row->inl.len = len;
+
+    // Rendered when first drawn
+    row->flags = ROW_STALE;
+    row->rsize = 0;
+    row->gap = 0;
+    row->render = NULL;
+}
+
+// -------------------------------------------------------------
+// Note that row `at` and the rows after it may have to be saved
+// -------------------------------------------------------------
+void editorMarkDirty(int at)
+{
+    if(at < E.dirtyrow)
+        E.dirtyrow = at;
+}
+
+// ----------------------------------------------------------------
+// Insert a row of text at the index specified by the `at` argument
+// ----------------------------------------------------------------
+void editorInsertRow(int at, char* s, size_t len)
+{
+    // If `at` row not within boundaries
+    if(at < 0 || at > E.numrows)
+        return;
+
+    erow row;
+    editorMakeRow(&row, s, len);
+
+    rsInsertRow(at, &row);
+    editorMarkDirty(at);
+    ++E.dirty;
+}
+
+// --------------------------------------------------
+// Freeing the memory owned by `erow` we are deleting
+// --------------------------------------------------
+void editorFreeRow(erow* row)
+{
+    editorFreeRender(row);
+    tbRowFree(row);
+}
+
+// --------------
+// Deleting a row
+// --------------
+void editorDelRow(int at)
+{
+    if(at < 0 || at >= E.numrows)
+        return;
+    
+    editorFreeRow(editorRowAt(at));
+    rsDeleteRow(at);
+    editorMarkDirty(at);
+    ++E.dirty;
+}
+
+// -----------------------------------
+// Insert single character into `erow`
+// -----------------------------------
+void editorRowInsertChar(erow* row, int at, int c)
+{
+    if(at < 0 || at > row->size)
+    {
+        at = row->size;
+    }
+
+    char ch = c;
+
+    // Patch an owned render string in place rather than rebuilding it
+    if((row->flags & (ROW_GAP | ROW_STALE)) == ROW_GAP)
+    {
+        int rx = editorRowCxToRx(row, at);
+        int w = 1;
+
+        editorRowMoveTabGap(row, editorRowTabsBefore(row, at));
+        tbRowInsert(row, at, &ch, 1);
+
+        if(ch == '\t')
+        {
+            char spaces[ATTO_TAB_STOP];
+
+            w = ATTO_TAB_STOP - rx % ATTO_TAB_STOP;
+            memset(spaces, ' ', w);
+            editorRenderInsert(row, rx, spaces, w);
+            editorRowAddTab(row, at, rx + w);
+        }
+        else
+        {
+            editorRenderInsert(row, rx, &ch, 1);
+        }
+
+        editorRenderRealign(row, at + 1, rx + w, w);
+    }
+    else
+    {
+        tbRowInsert(row, at, &ch, 1);
+        editorUpdateRow(row);
+    }
+
+    ++E.dirty;
+}
+
+// --------------------------------------------
+// Appends the text of `src` to the end of a row
+// --------------------------------------------
+void editorRowAppendRow(erow* row, erow* src)
+{
+    tbRowAppend(row, src);
+    editorUpdateRow(row);
+    ++E.dirty;
+}
+
+// --------------------------------
+// Deletes a character in an `erow`
+// --------------------------------
+void editorRowDelChar(erow* row, int at)
+{
+    if(at < 0 || at >= row->size)
+        return;
+    
+    if((row->flags & (ROW_GAP | ROW_STALE)) == ROW_GAP)
+    {
+        // Patch an owned render string in place rather than rebuilding it
+        int rx = editorRowCxToRx(row, at);
+        int w = 1;
+        int k = editorRowTabsBefore(row, at);
+        struct rowGap* g = editorRowGap(row);
+
+        editorRowMoveTabGap(row, k);
+
+        // Drop the tab from the index by widening its gap over it
+        if(k < g->ntabs && editorRowTab(row, k).cx == at)
+        {
+            w = ATTO_TAB_STOP - rx % ATTO_TAB_STOP;
+            --g->ntabs;
+        }
+
+        tbRowDelete(row, at, 1);
+        editorRenderDelete(row, rx, w);
+        editorRenderRealign(row, at, rx, -w);
+    }
+    else
+    {
+        tbRowDelete(row, at, 1);
+        editorUpdateRow(row);
+    }
+
+    ++E.dirty;
+}
+
+/*** Editor Operations ***/
+
+// --------------------------------------------------------
+// Take a chracter and use `editorRowInserChar()` to insert
+// that character into the position that the cursor is at
+// --------------------------------------------------------
+void editorInsertChar(int c)
+{
+    // If `E.cy == E.numrows`, then the cursor is on the tilde line after the
+    // end of the file, so we need to append a new row to the file before
+    // inserting a character there.
+    if(E.cy == E.numrows)
+    {
+        // The rows still being loaded come before any new one
+        if(E.load.active)
+        {
+            editorSetStatusMessage("Still loading, can't add lines at the end yet");
+            return;
+        }
+
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    char ch = c;
+    editorJournalAdd(JOURNAL_CHAR, &ch, 1);
+
+    editorMarkDirty(E.cy);
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    ++E.cx;
+}
+
+// ---------------
+// Insert new line
+// ---------------
+void editorInsertNewLine()
+{
+    if(E.cy == E.numrows && E.load.active)
+    {
+        editorSetStatusMessage("Still loading, can't add lines at the end yet");
+        return;
+    }
+
+    editorJournalAdd(JOURNAL_NEWLINE, NULL, 0);
+
+    if(E.cx == 0)
+    {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else
+    {
+        // Move the characters on the right of the cursor to the new row
+        editorMarkDirty(E.cy);
+        editorInsertRow(E.cy + 1, "", 0);
+        tbRowSplit(editorRowAt(E.cy), E.cx, editorRowAt(E.cy + 1));
+        editorUpdateRow(editorRowAt(E.cy));
+        editorUpdateRow(editorRowAt(E.cy + 1));
+    }
+
+    ++E.cy;
+    E.cx = 0;
+}
+
+// ----------------------------------------------------------------------
+// Insert a block of text at the cursor, as pasted into the terminal. It
+// is copied to the add buffer once and split into lines in one pass. Each
+// line after the first becomes a row pointing straight at that copy, and
+// the row the cursor was on is only changed once.
+// ----------------------------------------------------------------------
+void editorInsertText(const char* s, int len)
+{
+    if(len <= 0)
+        return;
+
+    if(E.cy == E.numrows)
+    {
+        if(E.load.active)
+        {
+            editorSetStatusMessage("Still loading, can't add lines at the end yet");
+            return;
+        }
+
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    editorJournalAdd(JOURNAL_TEXT, s, len);
+    editorMarkDirty(E.cy);
+
+    char* text = tbAppend(s, len);
+    char* end = text + len;
+
+    // Terminals send line breaks as '\r', but "\r\n" and '\n' are taken too
+    char* p = text;
+    while(p < end && *p != '\r' && *p != '\n')
+    {
+        ++p;
+    }
+
+    erow* row = editorRowAt(E.cy);
+
+    if(p == end)
+    {
+        tbRowInsertText(row, E.cx, text, len);
+        editorUpdateRow(row);
+        E.cx += len;
+        ++E.dirty;
+        return;
+    }
+
+    // The text after the cursor goes to the end of the last line
+    erow tail;
+    editorMakeRow(&tail, NULL, 0);
+    tbRowSplit(row, E.cx, &tail);
+    tbRowInsertText(row, E.cx, text, p - text);
+    editorUpdateRow(row);
+
+    while(p < end)
+    {
+        p += (*p == '\r' && p + 1 < end && p[1] == '\n') ? 2 : 1;
+
+        char* line = p;
+        while(p < end && *p != '\r' && *p != '\n')
+        {
+            ++p;
+        }
+
+        editorInsertRow(++E.cy, line, p - line);
+    }
+
+    row = editorRowAt(E.cy);
+    E.cx = row->size;
+    tbRowAppend(row, &tail);
+    tbRowFree(&tail);
+}
+
+// ------------------------------------------------------
+// Delete the character that is to the left of the cursor
+// ------------------------------------------------------
+void editorDelChar()
+{
+    // If the cursor is past the end of the file, we return immediately
+    if(E.cy == E.numrows)
+        return;
+
+    // If the cursor is at the beginning of a line
+    if(E.cx == 0 && E.cy == 0)
+        return;
+    
+    editorJournalAdd(JOURNAL_DELETE, NULL, 0);
+
+    erow* row = editorRowAt(E.cy);
+
+    if(E.cx > 0)    // Not first character of row
+    {
+        editorMarkDirty(E.cy);
+        editorRowDelChar(row, E.cx - 1);
+        --E.cx;
+    }
+    else    // First character of row
+    {
+        erow* prev = editorRowAt(E.cy - 1);
+        editorMarkDirty(E.cy - 1);
+        E.cx = prev->size;
+        editorRowAppendRow(prev, row);
+        editorDelRow(E.cy);
+        --E.cy;
+    }
+}
+
+/*** File I/O ***/
+
+// -------------------------------------------------------------------
+// Write out `n` iovecs at offset `off` of the file, carrying on after a
+// short write. The iovecs are used up in the process. Returns -1 on
+// error.
+// -------------------------------------------------------------------
+int editorWriteIov(int fd, struct iovec* iov, int n, off_t off)
+{
+    while(n > 0)
+    {
+        ssize_t w = pwritev(fd, iov, n, off);
+        if(w == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += w;
+
+        // Skip what was written, which may end inside an iovec
+        while(n > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+
+        if(n > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------
+// Add `len` bytes at `s` to the snapshot being saved
+// ---------------------------------------------------
+void editorSnapshotAdd(char* s, size_t len)
+{
+    struct saveJob* sv = &E.save;
+
+    if(len == 0)
+        return;
+
+    // Text still at the offset it had in the file that was opened
+    if(sv->same == sv->len && E.tb.orig && s == E.tb.orig + sv->len)
+        sv->same += len;
+
+    sv->len += len;
+
+    if(sv->niov == sv->iovcap)
+    {
+        sv->iovcap = sv->iovcap ? sv->iovcap * 2 : ATTO_SAVE_IOV;
+        sv->iov = realloc(sv->iov, sizeof(struct iovec) * sv->iovcap);
+        if(sv->iov == NULL)
+            die("realloc");
+    }
+
+    sv->iov[sv->niov].iov_base = s;
+    sv->iov[sv->niov].iov_len = len;
+    ++sv->niov;
+}
+
+// ----------------------------------------------------------------------
+// Take a snapshot of the text of every row, each followed by a newline,
+// as a list of the places it lies in the text buffer. Rows that have not
+// been edited still lie one after the other in the original buffer,
+// newlines included, so a mostly unedited file only takes a few entries.
+// Also works out where the first row that changed starts.
+// ----------------------------------------------------------------------
+void editorSnapshot()
+{
+    static char newline = '\n';
+    char* origend = E.tb.orig + E.tb.origlen;
+
+    // Text since the last break in the snapshot
+    char* run = &newline;
+    size_t runlen = 0;
+
+    E.save.niov = 0;
+    E.save.len = 0;
+    E.save.same = 0;
+    E.save.from = (size_t)-1;
+
+    // Leaves that were never looked at are read without being built
+    static erow tmp[ATTO_LEAF_ROWS];
+
+    int j = 0;
+    while(j < E.numrows)
+    {
+        int n;
+        erow* rows = rsPeekRows(j, &n, tmp);
+
+        int r;
+        for(r = 0; r < n; ++r)
+        {
+            piece* p = tbRowPieces(&rows[r]);
+
+            if(j + r == E.save.dirtyrow)
+                E.save.from = E.save.len + runlen;
+
+            int i;
+            for(i = 0; i < rows[r].npieces; ++i)
+            {
+                if(run + runlen != p[i].start)
+                {
+                    editorSnapshotAdd(run, runlen);
+                    run = p[i].start;
+                    runlen = 0;
+                }
+                runlen += p[i].len;
+            }
+
+            // Only the original buffer can be read past the end of a
+            // piece. The add buffer may not be filled in there yet.
+            char* end = run + runlen;
+            if(end >= E.tb.orig && end < origend && *end == '\n')
+            {
+                ++runlen;
+            }
+            else
+            {
+                editorSnapshotAdd(run, runlen);
+                run = &newline;
+                runlen = 1;
+            }
+        }
+
+        j += n;
+    }
+
+    editorSnapshotAdd(run, runlen);
+
+    // Only rows at the end were deleted
+    if(E.save.from > E.save.len)
+        E.save.from = E.save.len;
+
+    // Line endings the file was opened with are not kept, so until it
+    // is saved it only matches as far as the text is where it was
+    if(E.save.verbatim && E.save.same < E.save.from)
+        E.save.from = E.save.same;
+}
+
+// ------------------------------------------------------------
+// Write the snapshot to `fd`, ATTO_SAVE_IOV pieces at a time.
+// Returns -1 on error.
+// ------------------------------------------------------------
+int editorWriteSnapshot(int fd)
+{
+    off_t off = 0;
+
+    int i;
+    for(i = 0; i < E.save.niov; i += ATTO_SAVE_IOV)
+    {
+        int n = E.save.niov - i < ATTO_SAVE_IOV ? E.save.niov - i : ATTO_SAVE_IOV;
+
+        // The iovecs are used up by writing them
+        off_t next = off;
+        int k;
+        for(k = 0; k < n; ++k)
+        {
+            next += E.save.iov[i + k].iov_len;
+        }
+
+        if(editorWriteIov(fd, &E.save.iov[i], n, off) == -1)
+            return -1;
+        off = next;
+    }
+
+    return 0;
+}
+
+// -------------------------------------------------------------------
+// Split up to `max` rows off the `len` bytes of text at `p` into `rows`.
+// Text after the last line break only becomes a row when `last` says
+// it is the end of the file. Returns the number of rows made and sets
+// `used` to the number of bytes they took up.
+// -------------------------------------------------------------------
+int editorSplitRows(char* p, size_t len, int last, erow* rows, int max, size_t* used)
+{
+    uint32_t offs[ATTO_SCAN_ROWS];
+    int n = 0;
+    size_t off = 0;
+
+    while(n < max && off < len)
+    {
+        char* block = &p[off];
+        size_t left = len - off;
+        size_t blocklen = left < ATTO_SCAN_BLOCK ? left : ATTO_SCAN_BLOCK;
+        int want = max - n < ATTO_SCAN_ROWS ? max - n : ATTO_SCAN_ROWS;
+
+        size_t done;
+        int found = tbScanLines(block, blocklen, offs, want, &done);
+
+        // A single line longer than the block
+        if(found == 0 && blocklen < left)
+        {
+            blocklen = left;
+            found = tbScanLines(block, blocklen, offs, 1, &done);
+        }
+
+        size_t start = 0;
+        int i;
+        for(i = 0; i < found; ++i)
+        {
+            size_t nl = offs[i] & ~ATTO_CRLF;
+            size_t linelen = nl - start;
+
+            while((offs[i] & ATTO_CRLF) && linelen > 0 && block[start + linelen - 1] == '\r')
+            {
+                --linelen;
+            }
+
+            editorMakeRow(&rows[n++], &block[start], linelen);
+            start = nl + 1;
+        }
+        off += start;
+
+        // Reached the end of the text without filling `rows`
+        if(found < want && done == left)
+        {
+            size_t linelen = len - off;
+
+            // The last line of the file has no line break
+            if(last && linelen > 0)
+            {
+                while(linelen > 0 && p[off + linelen - 1] == '\r')
+                {
+                    --linelen;
+                }
+
+                editorMakeRow(&rows[n++], &p[off], linelen);
+                off = len;
+            }
+            break;
+        }
+    }
+
+    *used = off;
+    return n;
+}
+
+// A stretch of the file counted into leaves of rows by a worker thread
+struct loadChunk
+{
+    char* start;
+    size_t len;
+    rowLazy* leaves;
+    int nleaves;
+    pthread_t thread;
+    int started;
+};
+
+// ----------------------------------------------------------------------
+// Worker thread counting the lines of one chunk, ATTO_LEAF_ROWS at a
+// time, into leaves whose rows are only built once they are needed
+// ----------------------------------------------------------------------
+void* editorLoadChunk(void* arg)
+{
+    struct loadChunk* c = arg;
+    erow rows[ATTO_LEAF_ROWS];
+    int cap = 0;
+    size_t off = 0;
+
+    while(off < c->len)
+    {
+        if(c->nleaves == cap)
+        {
+            cap = cap ? cap * 2 : ATTO_SCAN_ROWS;
+            c->leaves = realloc(c->leaves, sizeof(rowLazy) * cap);
+            if(c->leaves == NULL)
+                die("realloc");
+        }
+
+        // A chunk ends on a line break or at the end of the file, so the
+        // text after its last line break is a line either way. Should the
+        // file have been cut short since, that still lets the chunk end.
+        size_t used;
+        int n = editorSplitRows(&c->start[off], c->len - off, 1, rows, ATTO_LEAF_ROWS, &used);
+
+        rowLazy* leaf = &c->leaves[c->nleaves++];
+        leaf->hdr.leaf = LEAF_LAZY;
+        leaf->hdr.n = n;
+        leaf->start = c->start + off - E.tb.orig;
+        leaf->len = used;
+
+        off += used;
+    }
+
+    return NULL;
+}
+
+// -----------------------------------------------------------
+// Number of worker threads to split `len` bytes of loading over
+// -----------------------------------------------------------
+int editorLoadThreads(size_t len)
+{
+    if(len < ATTO_PARALLEL_MIN)
+        return 1;
+
+    long n = E.load.maxthreads ? E.load.maxthreads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1)
+        n = 1;
+    if(n > ATTO_LOAD_THREADS_MAX)
+        n = ATTO_LOAD_THREADS_MAX;
+
+    return n;
+}
+
+// -------------------------------------------------------------------
+// Cut the text from `p` to `end` into at most `nthreads` chunks that
+// end on line breaks, and start a worker thread on each. Returns the
+// number of chunks.
+// -------------------------------------------------------------------
+int editorStartChunks(char* p, char* end, int nthreads, struct loadChunk* chunks)
+{
+    size_t chunklen = (end - p) / nthreads + 1;
+
+    int k;
+    for(k = 0; k < nthreads && p < end; ++k)
+    {
+        char* stop = (size_t)(end - p) > chunklen ? p + chunklen : end;
+
+        // Move the end of the chunk past the next line break
+        if(stop < end)
+        {
+            char* nl = memchr(stop, '\n', end - stop);
+            stop = nl ? nl + 1 : end;
+        }
+
+        chunks[k].start = p;
+        chunks[k].len = stop - p;
+        chunks[k].leaves = NULL;
+        chunks[k].nleaves = 0;
+        chunks[k].started = (pthread_create(&chunks[k].thread, NULL, editorLoadChunk, &chunks[k]) == 0);
+
+        p = stop;
+    }
+
+    return k;
+}
+
+// ------------------------------------------------------------------
+// Wait for the worker of a chunk. A chunk that could not get a thread
+// is split into rows here instead.
+// ------------------------------------------------------------------
+void editorFinishChunk(struct loadChunk* c)
+{
+    if(c->started)
+        pthread_join(c->thread, NULL);
+    else
+        editorLoadChunk(c);
+}
+
+// ---------------------------------------------------------------
+// Hand leaves over from the background loader to the main thread
+// ---------------------------------------------------------------
+void editorLoadQueue(rowLazy* leaves, int nleaves, size_t end)
+{
+    struct loadBatch* b = malloc(sizeof(struct loadBatch));
+    if(b == NULL)
+        die("malloc");
+
+    b->next = NULL;
+    b->leaves = leaves;
+    b->nleaves = nleaves;
+    b->end = end;
+
+    pthread_mutex_lock(&E.load.lock);
+    if(E.load.tail)
+        E.load.tail->next = b;
+    else
+        E.load.head = b;
+    E.load.tail = b;
+    pthread_cond_signal(&E.load.ready);
+    pthread_mutex_unlock(&E.load.lock);
+
+    write(E.load.wake[1], "", 1);
+}
+
+// ---------------------------------------------------------------------
+// Background loader thread. Counts the rest of the file into leaves of
+// rows one batch at a time, fanning each batch out over worker threads
+// for large files, and queues the leaves in file order.
+// ---------------------------------------------------------------------
+void* editorLoader(void* arg)
+{
+    (void)arg;
+
+    char* p = E.tb.orig + E.load.from;
+    char* end = E.tb.orig + E.tb.origlen;
+    int nthreads = editorLoadThreads(end - p);
+
+    while(p < end)
+    {
+        char* stop = (size_t)(end - p) > ATTO_LOAD_BATCH ? p + ATTO_LOAD_BATCH : end;
+        if(stop < end)
+        {
+            char* nl = memchr(stop, '\n', end - stop);
+            stop = nl ? nl + 1 : end;
+        }
+
+        struct loadChunk chunks[ATTO_LOAD_THREADS_MAX];
+        int n = editorStartChunks(p, stop, nthreads, chunks);
+
+        int k;
+        for(k = 0; k < n; ++k)
+        {
+            editorFinishChunk(&chunks[k]);
+            editorLoadQueue(chunks[k].leaves, chunks[k].nleaves, chunks[k].start + chunks[k].len - E.tb.orig);
+        }
+
+        p = stop;
+    }
+
+    pthread_mutex_lock(&E.load.lock);
+    E.load.done = 1;
+    pthread_cond_signal(&E.load.ready);
+    pthread_mutex_unlock(&E.load.lock);
+
+    write(E.load.wake[1], "", 1);
+
+    return NULL;
+}
+
+// ---------------------------------------------------------------
+// Start loading whatever has not been indexed yet in the background
+// ---------------------------------------------------------------
+void editorLoadStart()
+{
+    if(E.tb.indexed >= E.tb.origlen)
+        return;
+
+    E.load.from = E.tb.indexed;
+    E.load.head = NULL;
+    E.load.tail = NULL;
+    E.load.done = 0;
+
+    // Without a thread the rows are still indexed as they are needed.
+    // The pipe never blocks the loader, one byte in it is enough.
+    if(pipe2(E.load.wake, O_NONBLOCK | O_CLOEXEC) == -1)
+        return;
+
+    pthread_mutex_init(&E.load.lock, NULL);
+    pthread_cond_init(&E.load.ready, NULL);
+
+    if(pthread_create(&E.load.thread, NULL, editorLoader, NULL) == 0)
+    {
+        E.load.active = 1;
+    }
+    else
+    {
+        close(E.load.wake[0]);
+        close(E.load.wake[1]);
+    }
+}
+
+// ------------------------------------------------------------------
+// Add the rows the background loader has finished to the row store.
+// With `wait` set, blocks until the whole file has been loaded.
+// Returns 1 if anything changed.
+// ------------------------------------------------------------------
+int editorLoadPoll(int wait)
+{
+    int changed = 0;
+
+    while(E.load.active)
+    {
+        pthread_mutex_lock(&E.load.lock);
+        while(wait && !E.load.done && E.load.head == NULL)
+        {
+            pthread_cond_wait(&E.load.ready, &E.load.lock);
+        }
+
+        struct loadBatch* b = E.load.head;
+        int done = E.load.done;
+        E.load.head = NULL;
+        E.load.tail = NULL;
+        pthread_mutex_unlock(&E.load.lock);
+
+        while(b)
+        {
+            struct loadBatch* next = b->next;
+
+            // Only the leaves go into the row store, each row is built
+            // once something looks at it
+            int i;
+            for(i = 0; i < b->nleaves; ++i)
+            {
+                rowLazy* leaf = arenaAlloc(sizeof(rowLazy));
+                *leaf = b->leaves[i];
+                rsAppendLeaf(&leaf->hdr);
+            }
+            E.tb.indexed = b->end;
+            changed = 1;
+
+            free(b->leaves);
+            free(b);
+            b = next;
+        }
+
+        if(done)
+        {
+            pthread_join(E.load.thread, NULL);
+            pthread_mutex_destroy(&E.load.lock);
+            pthread_cond_destroy(&E.load.ready);
+            close(E.load.wake[0]);
+            close(E.load.wake[1]);
+            E.load.active = 0;
+            E.tb.indexed = E.tb.origlen;
+            changed = 1;
+        }
+
+        if(!wait)
+            break;
+    }
+
+    return changed;
+}
+
+// -------------------------------------------------------------------
+// Split the original buffer into rows until there are at least `upto`
+// rows or the whole buffer has been indexed. Rows are only built once
+// something needs them, so opening a file costs no more than the part
+// of it that is looked at.
+// -------------------------------------------------------------------
+void editorIndexRows(int upto)
+{
+    static erow batch[ATTO_SCAN_ROWS];
+
+    // The rest of the file is on its way from the background loader.
+    // Only saving has to wait for all of it.
+    if(E.load.active)
+    {
+        editorLoadPoll(upto == INT_MAX);
+        return;
+    }
+
+    while(E.numrows < upto && E.tb.indexed < E.tb.origlen)
+    {
+        int want = upto - E.numrows < ATTO_SCAN_ROWS ? upto - E.numrows : ATTO_SCAN_ROWS;
+
+        size_t used;
+        int n = editorSplitRows(E.tb.orig + E.tb.indexed, E.tb.origlen - E.tb.indexed, 1, batch, want, &used);
+
+        rsAppendRows(batch, n);
+        E.tb.indexed += used;
+    }
+}
+
+// ---------
+// Open file
+// ---------
+void editorOpen(char* filename)
+{
+    // Get name of file
+    free(E.filename);
+    E.filename = strdup(filename);      // `strdup()` makes copy of string
+
+    // A save cut short goes first, so the file is opened as it was saved
+    editorJournalFinishSave(filename);
+
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1)
+        die("open");
+
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+        die("fstat");
+
+    // Map the file as the original buffer of the piece table. Rows point
+    // straight into the mapping, so nothing is copied or even read from
+    // disk until it is shown. Should the file be cut short on disk while
+    // it is open, as `logrotate` does with copytruncate, the mapping
+    // becomes a private copy of what is left (see `tbBusHandler()`).
+    if(st.st_size > 0)
+    {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED)
+        {
+            E.tb.orig = map;
+            E.tb.origlen = st.st_size;
+            E.tb.mapped = 1;
+            E.tb.pagesize = sysconf(_SC_PAGESIZE);
+
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = tbBusHandler;
+            sa.sa_flags = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGBUS, &sa, NULL);
+        }
+    }
+
+    // Files that can't be mapped are read in a single pass instead. Pipes
+    // and files under /proc report a size of 0, so read until end of file.
+    if(!E.tb.mapped)
+    {
+        size_t cap = st.st_size + 1;
+        E.tb.orig = malloc(cap);
+        if(E.tb.orig == NULL)
+            die("malloc");
+
+        while(1)
+        {
+            if(E.tb.origlen == cap)
+            {
+                cap = cap < ATTO_INPUT_BUF ? ATTO_INPUT_BUF : cap * 2;
+                E.tb.orig = realloc(E.tb.orig, cap);
+                if(E.tb.orig == NULL)
+                    die("realloc");
+            }
+
+            ssize_t nread = read(fd, &E.tb.orig[E.tb.origlen], cap - E.tb.origlen);
+            if(nread == -1 && errno != EINTR)
+                die("read");
+            if(nread == 0)
+                break;
+            if(nread > 0)
+                E.tb.origlen += nread;
+        }
+    }
+    close(fd);
+
+    // Show the first screen straight away and load the rest in the background
+    editorIndexRows(E.screenrows + 1);
+    editorLoadStart();
+
+    E.dirty = 0;
+
+    // Until a row changes, saving has nothing to write
+    E.dirtyrow = INT_MAX;
+    E.save.disk = st;
+    E.save.loaded = st;
+    E.save.known = 1;
+    E.save.verbatim = 1;
+
+    // Edits left behind by a crash
+    editorJournalRecover(&st);
+}
+
+// ----------------------------------------------------------------------
+// Save over the file in place. A crash or a full disk half way through
+// leaves it damaged. Returns -1 on error.
+// ----------------------------------------------------------------------
+int editorSaveInPlace()
+{
+    int fd = open(E.save.filename, O_RDWR | O_CREAT, 0644);     // 0644 is the standard permissions for text files
+    if(fd == -1)
+        return -1;
+
+    if(editorWriteSnapshot(fd) == -1 || ftruncate(fd, E.save.len) == -1 || fstat(fd, &E.save.disk) == -1)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return close(fd);
+}
+
+// ----------------------------------------------------------------------
+// Sync the directory `path` is in, so the files created in it or renamed
+// there last through a crash
+// ----------------------------------------------------------------------
+void editorSyncDir(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    char* dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(dfd != -1)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(dir);
+}
+
+// ----------------------------------------------------------------------
+// Save to a temporary file in the same directory and rename it over the
+// file once it is safely on disk, so the file is always either the old
+// or the new version. Returns -1 on error.
+// ----------------------------------------------------------------------
+int editorSaveAtomic()
+{
+    // Replace the file a symbolic link points to, not the link
+    char* target = realpath(E.save.filename, NULL);
+    if(target == NULL)
+        target = strdup(E.save.filename);
+
+    char* tmpname = malloc(strlen(target) + 8);
+    sprintf(tmpname, "%s.XXXXXX", target);
+
+    int fd = mkstemp(tmpname);
+    if(fd == -1)
+    {
+        free(tmpname);
+        free(target);
+        return -1;
+    }
+
+    // Keep the mode and owner of the file. Changing the owner only
+    // works for root, and the file is saved anyway otherwise.
+    struct stat st;
+    if(stat(target, &st) == 0)
+    {
+        fchmod(fd, st.st_mode & 07777);
+        fchown(fd, st.st_uid, st.st_gid);
+    }
+    else
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+    }
+
+    // Claim the space up front, so a full disk fails the save before
+    // anything is written. Not every file system can do this.
+    int ok = E.save.len == 0 || fallocate(fd, 0, 0, E.save.len) == 0 || errno == EOPNOTSUPP || errno == ENOSYS;
+
+    ok = ok && editorWriteSnapshot(fd) != -1 && fsync(fd) != -1 && fstat(fd, &E.save.disk) != -1;
+
+    int err = ok ? 0 : errno;
+    if(close(fd) == -1 && ok)
+    {
+        err = errno;
+        ok = 0;
+    }
+
+    if(ok && rename(tmpname, target) == -1)
+    {
+        err = errno;
+        ok = 0;
+    }
+
+    // Make the rename itself last
+    if(ok)
+        editorSyncDir(target);
+    else
+        unlink(tmpname);
+
+    free(tmpname);
+    free(target);
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+// ----------------------------------------------------------------------
+// Whether two `stat()` results are of the same file
+// ----------------------------------------------------------------------
+int editorSameFile(struct stat* a, struct stat* b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+// ----------------------------------------------------------------------
+// Write the part of the snapshot an incremental save writes, from the
+// first row that changed on, leaving out text already in its place when
+// `self` is set. Without `at` it goes to its place in the file `fd`.
+// With `at` it goes to `fd` from `*at` on as `saveExtent`s, for a redo
+// file, and `*at` is moved past it. Returns -1 on error.
+// ----------------------------------------------------------------------
+int editorSaveExtents(int fd, int self, off_t* at)
+{
+    struct iovec batch[ATTO_SAVE_IOV];
+    struct saveExtent ext[ATTO_SAVE_IOV / 2];
+    int n = 0;
+    off_t base = at ? *at : 0;
+    off_t end = base;
+    char* orig = E.tb.orig;
+    size_t from = E.save.from;
+    size_t pos = 0;
+
+    E.save.rewritten = 0;
+
+    int i;
+    for(i = 0; i < E.save.niov; ++i)
+    {
+        char* b = E.save.iov[i].iov_base;
+        size_t len = E.save.iov[i].iov_len;
+        size_t start = pos;
+
+        pos += len;
+        if(pos <= from)
+            continue;
+
+        // Only the part from `from` on
+        if(start < from)
+        {
+            b += from - start;
+            len -= from - start;
+            start = from;
+        }
+
+        // Text already in its place is left alone
+        if(self && b == orig + start)
+            continue;
+
+        // Extents in a redo file follow each other, text in the file goes
+        // to its place
+        off_t dst = at ? end : (off_t)start;
+        int need = at ? 2 : 1;
+
+        if(n > 0 && (n + need > ATTO_SAVE_IOV || dst != end))
+        {
+            if(editorWriteIov(fd, batch, n, base) == -1)
+                return -1;
+            n = 0;
+        }
+
+        if(n == 0)
+            base = end = dst;
+
+        if(at)
+        {
+            struct saveExtent* e = &ext[n / 2];
+            e->off = start;
+            e->len = len;
+            batch[n].iov_base = e;
+            batch[n].iov_len = sizeof(*e);
+            ++n;
+            end += sizeof(*e);
+        }
+
+        batch[n].iov_base = b;
+        batch[n].iov_len = len;
+        ++n;
+        end += len;
+        E.save.rewritten += len;
+    }
+
+    if(n > 0 && editorWriteIov(fd, batch, n, base) == -1)
+        return -1;
+
+    if(at)
+        *at = end;
+    return 0;
+}
+
+// ----------------------------------------------------------------------
+// Write the redo file `name` of an incremental save over the file `st`,
+// and sync it. The header goes last, so a redo file cut short is never
+// taken for a whole one. Returns -1 on error.
+// ----------------------------------------------------------------------
+int editorSaveRedo(const char* name, int self, struct stat* st)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1)
+        return -1;
+
+    struct saveRedo rd;
+    memset(&rd, 0, sizeof(rd));
+    memcpy(rd.magic, "attosav1", sizeof(rd.magic));
+    rd.dev = st->st_dev;
+    rd.ino = st->st_ino;
+    rd.size = E.save.len;
+    rd.saved = E.journal.saved;
+    memcpy(rd.base.magic, "attojnl1", sizeof(rd.base.magic));
+    rd.base.size = st->st_size;
+    rd.base.mtime = st->st_mtim.tv_sec;
+    rd.base.mtime_nsec = st->st_mtim.tv_nsec;
+
+    off_t pos = sizeof(rd);
+    struct iovec iov = { &rd, sizeof(rd) };
+    int ok = editorSaveExtents(fd, self, &pos) != -1 && fdatasync(fd) != -1 &&
+             editorWriteIov(fd, &iov, 1, 0) != -1 && fdatasync(fd) != -1;
+
+    int err = ok ? 0 : errno;
+    if(close(fd) == -1 && ok)
+    {
+        err = errno;
+        ok = 0;
+    }
+
+    // The redo file itself has to be there after a crash
+    if(ok)
+        editorSyncDir(name);
+
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+// ----------------------------------------------------------------------
+// Remove the redo file of `filename` once the file is saved. It is
+// emptied first: should the removal not last through a crash, it must
+// not be found and written over a later version of the file.
+// ----------------------------------------------------------------------
+void editorDropRedo(const char* filename)
+{
+    char* name = editorJournalName(filename, "save");
+
+    int fd = open(name, O_WRONLY | O_CLOEXEC);
+    if(fd != -1)
+    {
+        ftruncate(fd, 0);
+        fdatasync(fd);
+        close(fd);
+        unlink(name);
+    }
+    free(name);
+}
+
+// ----------------------------------------------------------------------
+// Save by writing only the snapshot from the first row that changed on,
+// over the file as it was last read or written, and cutting it to the
+// new length. Returns 1 without touching the file if that can't be done
+// safely, so a full save is needed, or -1 on error.
+//
+// While the file is the one mapped as the original buffer, rows point
+// into it and see whatever is written there. So the text they use has
+// to stay as it is: it must either lie before the part that is written,
+// or already be at its place in the file, which is then left alone.
+//
+// Nothing is written over the file before its redo file holds all of it,
+// for `editorJournalFinishSave()` to finish the save after a crash. The
+// redo file stays until a save succeeds.
+// ----------------------------------------------------------------------
+int editorSaveIncremental()
+{
+    int fd = open(E.save.filename, O_WRONLY);
+    if(fd == -1)
+        return 1;
+
+    // Changed by someone else since
+    struct stat st;
+    if(fstat(fd, &st) == -1 || !editorSameFile(&st, &E.save.disk) || st.st_size != E.save.disk.st_size ||
+       st.st_mtim.tv_sec != E.save.disk.st_mtim.tv_sec || st.st_mtim.tv_nsec != E.save.disk.st_mtim.tv_nsec)
+    {
+        close(fd);
+        return 1;
+    }
+
+    int self = E.tb.mapped && editorSameFile(&st, &E.save.loaded);
+    char* orig = E.tb.orig;
+    size_t from = E.save.from;
+    size_t pos = 0;
+
+    int i;
+    for(i = 0; self && i < E.save.niov; ++i)
+    {
+        char* b = E.save.iov[i].iov_base;
+        size_t len = E.save.iov[i].iov_len;
+
+        if(b >= orig && b < orig + E.tb.origlen && (size_t)(b - orig) != pos && (size_t)(b - orig) + len > from)
+        {
+            close(fd);
+            return 1;
+        }
+        pos += len;
+    }
+
+    // What is about to be written goes to disk first, so a crash halfway
+    // through leaves enough behind to finish the save. This comes before
+    // anything that touches the file, as even `fallocate()` changes its
+    // time, and the journal would no longer match it.
+    char* redo = editorJournalName(E.save.filename, "save");
+    if(editorSaveRedo(redo, self, &st) == -1)
+    {
+        unlink(redo);
+        free(redo);
+        close(fd);
+        return 1;
+    }
+    free(redo);
+
+    // Claim the space for any growth, so a full disk fails the save
+    // before anything is written
+    int ok = E.save.len <= (size_t)st.st_size ||
+             fallocate(fd, FALLOC_FL_KEEP_SIZE, st.st_size, E.save.len - st.st_size) != -1 ||
+             errno == EOPNOTSUPP || errno == ENOSYS;
+
+    ok = ok && editorSaveExtents(fd, self, NULL) != -1;
+    ok = ok && ftruncate(fd, E.save.len) != -1 && fsync(fd) != -1 && fstat(fd, &E.save.disk) != -1;
+
+    int err = ok ? 0 : errno;
+    if(close(fd) == -1 && ok)
+    {
+        err = errno;
+        ok = 0;
+    }
+
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+// ----------------------------------------------------------------------
+// Save the snapshot, only writing what changed if it can. Otherwise rows
+// still point into the mapping of the file, so it must not be overwritten
+// in place. Runs on the writer thread, and wakes up the main thread when
+// it is done.
+// ----------------------------------------------------------------------
+void* editorSaveThread(void* arg)
+{
+    (void)arg;
+
+    int r = (ATTO_INCREMENTAL_SAVE && E.save.known) ? editorSaveIncremental() : 1;
+    if(r == 1)
+    {
+        E.save.rewritten = E.save.len;
+        r = (ATTO_ATOMIC_SAVE || E.tb.mapped) ? editorSaveAtomic() : editorSaveInPlace();
+    }
+    E.save.err = (r == -1) ? errno : 0;
+
+    // A save that failed halfway can only be finished from its redo file
+    if(r == 0 && ATTO_INCREMENTAL_SAVE)
+        editorDropRedo(E.save.filename);
+
+    write(E.save.wake[1], "", 1);
+    return NULL;
+}
+
+// ------------------------------------------------
+// Report how a save went and free the snapshot
+// ------------------------------------------------
+void editorSaveDone()
+{
+    close(E.save.wake[0]);
+    close(E.save.wake[1]);
+
+    free(E.save.filename);
+    free(E.save.iov);
+    E.save.iov = NULL;
+    E.save.iovcap = 0;
+
+    if(E.save.err)
+    {
+        // The file may be half written, so the next save writes all of it
+        E.save.known = 0;
+
+        // Writing from a mapped file cut short on disk fails instead of
+        // raising SIGBUS
+        if(E.save.err == EFAULT && E.tb.mapped)
+            E.tb.cut = 1;
+
+        editorMarkDirty(E.save.dirtyrow);
+        editorSetStatusMessage("Can't save! I/O error : %s", strerror(E.save.err));
+        return;
+    }
+
+    E.save.known = 1;
+    E.save.verbatim = 0;
+    editorJournalSaved();
+
+    // The mapping must not reach past the end of a file cut short
+    if(E.tb.mapped && editorSameFile(&E.save.disk, &E.save.loaded) && E.save.len < E.tb.origlen)
+    {
+        E.tb.origlen = E.save.len;
+        E.tb.indexed = E.save.len;
+    }
+
+    // Edits made during the save are still unsaved
+    E.dirty -= E.save.dirty;
+
+    if(E.save.rewritten < E.save.len)
+        editorSetStatusMessage("%zu bytes saved, %zu rewritten", E.save.len, E.save.rewritten);
+    else
+        editorSetStatusMessage("%zu bytes written to disk", E.save.len);
+}
+
+// -------------------------------------------------
+// Wait for the save in progress to end, if any
+// -------------------------------------------------
+void editorSaveFinish()
+{
+    if(!E.save.active)
+        return;
+
+    pthread_join(E.save.thread, NULL);
+    E.save.active = 0;
+    editorSaveDone();
+}
+
+// ----------------------------------------------------------------------
+// Write the rows of text to disk. Only a snapshot of the text is taken
+// here; the writer thread saves it while editing carries on.
+// ----------------------------------------------------------------------
+void editorSave()
+{
+    if(E.save.active)
+    {
+        editorSetStatusMessage("Still saving, try again once it is done");
+        return;
+    }
+
+    // New file
+    if(E.filename == NULL)
+    {
+        E.filename = editorPrompt("Save as : %s (ESC to cancel)");
+        if(E.filename == NULL)
+        {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+    }
+
+    // Every row is needed for saving
+    editorIndexRows(INT_MAX);
+
+    // Rows changed from now on are left for the next save, and so are
+    // the journal records after this point
+    E.save.dirtyrow = E.dirtyrow;
+    E.dirtyrow = INT_MAX;
+    editorJournalCommit();
+    E.journal.saved = E.journal.size;
+
+    editorSnapshot();
+    E.save.filename = strdup(E.filename);
+    E.save.dirty = E.dirty;
+
+    if(pipe2(E.save.wake, O_CLOEXEC) == -1)
+        die("pipe");
+
+    if(pthread_create(&E.save.thread, NULL, editorSaveThread, NULL) == 0)
+    {
+        E.save.active = 1;
+        return;
+    }
+
+    // Without a thread, save right away
+    editorSaveThread(NULL);
+    editorSaveDone();
+}
+
+/*** Journal ***/
+
+// ----------------------------------------------------------------------
+// Name of the journal of a file, or of its other files with extension
+// `ext`: the file name with a dot in front and ".journal" after, in the
+// same directory
+// ----------------------------------------------------------------------
+char* editorJournalName(const char* filename, const char* ext)
+{
+    const char* slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+
+    char* name = malloc(strlen(filename) + strlen(ext) + 3);
+    sprintf(name, "%.*s.%s.%s", dirlen, filename, filename + dirlen, ext);
+    return name;
+}
+
+// ----------------------------------------------------------------------
+// Log an edit about to be made at the cursor, with `len` bytes of text
+// at `s`. It is only written out by `editorJournalCommit()`, together
+// with the other edits of the next ATTO_JOURNAL_DELAY ms.
+// ----------------------------------------------------------------------
+void editorJournalAdd(int op, const char* s, int len)
+{
+    struct journal* j = &E.journal;
+
+    // Edits to a file without a name have nowhere to go
+    if(E.filename == NULL || j->replaying || j->kept)
+        return;
+
+    struct journalRecord r = { op, E.cy, E.cx, len };
+
+    if(j->len + sizeof(r) + len > j->cap)
+    {
+        while(j->len + sizeof(r) + len > j->cap)
+        {
+            j->cap = j->cap ? j->cap * 2 : ATTO_INPUT_BUF;
+        }
+
+        j->buf = realloc(j->buf, j->cap);
+        if(j->buf == NULL)
+            die("realloc");
+    }
+
+    memcpy(&j->buf[j->len], &r, sizeof(r));
+    if(len > 0)
+        memcpy(&j->buf[j->len + sizeof(r)], s, len);
+    j->len += sizeof(r) + len;
+
+    if(j->commit_time == 0)
+        j->commit_time = editorNowMs() + ATTO_JOURNAL_DELAY;
 }
 
-// --------------------------------
-// Deletes a character in an `erow`
-// --------------------------------
-void editorRowDelChar(erow* row, int at)
+// ----------------------------------------------------------------------
+// Write out the edits logged so far and sync them to disk. The journal
+// is created on the first commit after a save, against the file as that
+// save left it.
+// ----------------------------------------------------------------------
+void editorJournalCommit()
 {
-    if(at < 0 || at >= row->size)
+    struct journal* j = &E.journal;
+
+    j->commit_time = 0;
+    if(j->len == 0)
         return;
-    
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    ++E.dirty;
-}
 
-/*** Editor Operations ***/
+    // Which file the edits apply to is only known once the save is done,
+    // and `editorJournalSaved()` commits them then
+    if(j->fd == -1 && E.save.active)
+        return;
 
-// --------------------------------------------------------
-// Take a chracter and use `editorRowInserChar()` to insert
-// that character into the position that the cursor is at
-// --------------------------------------------------------
-void editorInsertChar(int c)
-{
-    // If `E.cy == E.numrows`, then the cursor is on the tilde line after the
-    // end of the file, so we need to append a new row to the file before
-    // inserting a character there.
-    if(E.cy == E.numrows)
+    if(j->fd == -1)
     {
-        editorInsertRow(E.numrows, "", 0);
+        if(j->name == NULL)
+            j->name = editorJournalName(E.filename, "journal");
+
+        struct journalHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "attojnl1", sizeof(h.magic));
+        h.size = E.save.disk.st_size;
+        h.mtime = E.save.disk.st_mtim.tv_sec;
+        h.mtime_nsec = E.save.disk.st_mtim.tv_nsec;
+
+        // Read as well as written, for `editorJournalSaved()`
+        j->fd = open(j->name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if(j->fd != -1 && pwrite(j->fd, &h, sizeof(h), 0) != sizeof(h))
+        {
+            close(j->fd);
+            j->fd = -1;
+        }
+
+        if(j->fd == -1)
+        {
+            editorSetStatusMessage("Can't write journal %s : %s", j->name, strerror(errno));
+            j->len = 0;
+            return;
+        }
+
+        j->size = sizeof(h);
     }
 
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    ++E.cx;
+    // A failed write is written over by the next commit
+    struct iovec iov = { j->buf, j->len };
+    if(editorWriteIov(j->fd, &iov, 1, j->size) == -1 || fdatasync(j->fd) == -1)
+    {
+        editorSetStatusMessage("Can't write journal %s : %s", j->name, strerror(errno));
+        return;
+    }
+
+    j->size += j->len;
+    j->len = 0;
 }
 
-// ---------------
-// Insert new line
-// ---------------
-void editorInsertNewLine()
+// ----------------------------------------------------------------------
+// Start the journal again after a save. Only the edits made while the
+// save was running are still unsaved, so they are all it keeps.
+// ----------------------------------------------------------------------
+void editorJournalSaved()
 {
-    if(E.cx == 0)
+    struct journal* j = &E.journal;
+
+    if(j->fd != -1)
     {
-        editorInsertRow(E.cy, "", 0);
+        // Records written since the snapshot go before those in memory
+        size_t tail = j->size - j->saved;
+        if(tail > 0)
+        {
+            char* rec = malloc(tail);
+            if(rec == NULL)
+                die("malloc");
+
+            size_t got = 0;
+            int err = 0;
+            while(got < tail)
+            {
+                ssize_t n = pread(j->fd, &rec[got], tail - got, j->saved + got);
+                if(n == -1 && errno == EINTR)
+                    continue;
+                if(n <= 0)
+                {
+                    err = (n == -1) ? errno : 0;
+                    break;
+                }
+                got += n;
+            }
+
+            if(got == tail)
+            {
+                if(j->len + tail > j->cap)
+                {
+                    j->cap = j->len + tail;
+                    j->buf = realloc(j->buf, j->cap);
+                    if(j->buf == NULL)
+                        die("realloc");
+                }
+
+                memmove(&j->buf[tail], j->buf, j->len);
+                memcpy(j->buf, rec, tail);
+                j->len += tail;
+            }
+            else
+            {
+                // Those edits are still unsaved, but no longer journaled
+                editorSetStatusMessage("Can't read journal %s : %s", j->name,
+                                       err ? strerror(err) : "file cut short");
+            }
+            free(rec);
+        }
+
+        close(j->fd);
+        unlink(j->name);
+        j->fd = -1;
+        j->size = 0;
     }
-    else
+
+    editorJournalCommit();
+}
+
+// --------------------------------------------------
+// Delete the journal, when its edits are given up on
+// --------------------------------------------------
+void editorJournalRemove()
+{
+    struct journal* j = &E.journal;
+
+    if(j->fd != -1)
     {
-        // Move the characters on the right of the cursor to the new row
-        erow* row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        close(j->fd);
+        unlink(j->name);
+        j->fd = -1;
     }
 
-    ++E.cy;
-    E.cx = 0;
+    j->len = 0;
+    j->commit_time = 0;
 }
 
-// ------------------------------------------------------
-// Delete the character that is to the left of the cursor
-// ------------------------------------------------------
-void editorDelChar()
+// ----------------------------------------------------------------------
+// Redo one edit from the journal. Returns 0 if it doesn't fit the text,
+// as happens when the end of the journal was cut short.
+// ----------------------------------------------------------------------
+int editorJournalApply(struct journalRecord* r, char* s)
 {
-    // If the cursor is past the end of the file, we return immediately
-    if(E.cy == E.numrows)
-        return;
+    if(r->row > (uint32_t)E.numrows)
+        return 0;
 
-    // If the cursor is at the beginning of a line
-    if(E.cx == 0 && E.cy == 0)
-        return;
-    
-    erow* row = &E.row[E.cy];
+    erow* row = (r->row < (uint32_t)E.numrows) ? editorRowAt(r->row) : NULL;
+    if(r->col > (uint32_t)(row ? row->size : 0))
+        return 0;
 
-    if(E.cx > 0)    // Not first character of row
-    {
-        editorRowDelChar(row, E.cx - 1);
-        --E.cx;
-    }
-    else    // First character of row
+    E.cy = r->row;
+    E.cx = r->col;
+
+    switch(r->op)
     {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        --E.cy;
+        case JOURNAL_CHAR:
+            if(r->len != 1)
+                return 0;
+            editorInsertChar(s[0]);
+            break;
+
+        case JOURNAL_TEXT:
+            editorInsertText(s, r->len);
+            break;
+
+        case JOURNAL_NEWLINE:
+            editorInsertNewLine();
+            break;
+
+        case JOURNAL_DELETE:
+            editorDelChar();
+            break;
+
+        default:
+            return 0;
     }
-}
 
-/*** File I/O ***/
+    return 1;
+}
 
-// ---------------------------------------------------------
-// Converts our array of `erow` structs into a single string
-// that is ready to be written out to a file
-// ---------------------------------------------------------
-char* editorRowsToString(int* buflen)
+// ----------------------------------------------------------------------
+// Write the text in the redo file `rfd`, with header `rd`, over `filename`
+// again, whatever part of it made it there before, and cut the file to
+// its saved length. `st` is set to the file as saved. Returns 0 if the
+// redo file is for another file, 1 once done, or -1 on error.
+// ----------------------------------------------------------------------
+int editorRedoSave(int rfd, struct saveRedo* rd, const char* filename, struct stat* st)
 {
-    // Add up the lengths of each row of text
-    int totlen = 0;
-    int j;
-    for(j = 0; j < E.numrows; ++j)
+    struct stat rst;
+    int fd = open(filename, O_WRONLY);
+    if(fd == -1)
+        return 0;
+
+    if(fstat(fd, st) == -1 || st->st_dev != rd->dev || st->st_ino != rd->ino || fstat(rfd, &rst) == -1)
     {
-        totlen += E.row[j].size + 1;
+        close(fd);
+        return 0;
     }
-    *buflen = totlen;
-
-    // Allocate the required memory
-    char* buf = malloc(totlen);
-    char* p = buf;
 
-    // Loop through the rows and `memcpy()` the contents of each row to the
-    // end of the buffer, appending a newline character after each row.
-    for(j = 0; j < E.numrows; ++j)
+    off_t pos = sizeof(*rd);
+    int ok = 1;
+    while(ok && pos < rst.st_size)
     {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        ++p;
+        struct saveExtent e;
+        ok = pread(rfd, &e, sizeof(e), pos) == sizeof(e) && e.len <= (uint64_t)(rst.st_size - pos) - sizeof(e);
+        pos += sizeof(e);
+
+        loff_t src = pos;
+        loff_t dst = e.off;
+        size_t left = ok ? e.len : 0;
+        while(left > 0)
+        {
+            ssize_t n = copy_file_range(rfd, &src, fd, &dst, left, 0);
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                ok = 0;
+                break;
+            }
+            left -= n;
+        }
+        pos += e.len;
     }
 
-    return buf;
+    ok = ok && ftruncate(fd, rd->size) != -1 && fsync(fd) != -1 && fstat(fd, st) != -1;
+
+    int err = ok ? 0 : errno;
+    close(fd);
+    errno = err;
+    return ok ? 1 : -1;
 }
 
-// ---------
-// Open file
-// ---------
-void editorOpen(char* filename)
+// ----------------------------------------------------------------------
+// Finish an incremental save of `filename` that a crash cut short, from
+// the redo file it left behind, before the file is opened. The file is
+// taken to be untouched since. The journal edits made after the save's
+// snapshot are kept, against the file as saved.
+// ----------------------------------------------------------------------
+void editorJournalFinishSave(const char* filename)
 {
-    // Get name of file
-    free(E.filename);
-    E.filename = strdup(filename);      // `strdup()` makes copy of string
+    char* name = editorJournalName(filename, "save");
+    int rfd = open(name, O_RDONLY | O_CLOEXEC);
+    free(name);
+    if(rfd == -1)
+        return;
 
-    FILE *fp = fopen(filename, "r");
-    if(!fp)
-        die("fopen");
+    struct saveRedo rd;
+    struct stat st;
+    int r = 0;
+    if(pread(rfd, &rd, sizeof(rd), 0) == sizeof(rd) && memcmp(rd.magic, "attosav1", sizeof(rd.magic)) == 0)
+        r = editorRedoSave(rfd, &rd, filename, &st);
+    close(rfd);
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    linelen = getline(&line, &linecap, fp);
+    if(r == -1)
+    {
+        editorSetStatusMessage("Can't finish the save of %s that was cut short : %s", filename, strerror(errno));
+        return;
+    }
 
-    // Read all lines of text from file
-    while((linelen = getline(&line, &linecap, fp)) != -1)
+    if(r == 0)
+        return;
+
+    // Start the journal again against the file as saved. A journal that
+    // isn't the one the save was for is left alone.
+    name = editorJournalName(filename, "journal");
+    int jfd = open(name, O_RDONLY | O_CLOEXEC);
+
+    struct stat jst;
+    struct journalHeader h;
+    if(jfd != -1 && fstat(jfd, &jst) == 0 && pread(jfd, &h, sizeof(h), 0) == sizeof(h) &&
+       memcmp(&h, &rd.base, sizeof(h)) == 0)
     {
-        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        size_t len = (uint64_t)jst.st_size > rd.saved ? jst.st_size - rd.saved : 0;
+        char* buf = malloc(sizeof(h) + len);
+        if(buf == NULL)
+            die("malloc");
+
+        // A record cut short at the end is dropped on recovery
+        size_t got = 0;
+        while(got < len)
         {
-            --linelen;
+            ssize_t n = pread(jfd, &buf[sizeof(h) + got], len - got, rd.saved + got);
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                break;
+            got += n;
         }
 
-        editorInsertRow(E.numrows, line, linelen);
+        if(got == 0)
+        {
+            unlink(name);
+        }
+        else
+        {
+            h.size = st.st_size;
+            h.mtime = st.st_mtim.tv_sec;
+            h.mtime_nsec = st.st_mtim.tv_nsec;
+            memcpy(buf, &h, sizeof(h));
+
+            // Replaced whole, so a crash now leaves one or the other
+            char* tmpname = malloc(strlen(name) + 8);
+            sprintf(tmpname, "%s.XXXXXX", name);
+
+            struct iovec iov = { buf, sizeof(h) + got };
+            int tfd = mkstemp(tmpname);
+            if(tfd == -1 || editorWriteIov(tfd, &iov, 1, 0) == -1 || fdatasync(tfd) == -1 ||
+               rename(tmpname, name) == -1)
+                unlink(tmpname);
+            if(tfd != -1)
+                close(tfd);
+            free(tmpname);
+        }
+        free(buf);
     }
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    if(jfd != -1)
+        close(jfd);
+    free(name);
+
+    editorDropRedo(filename);
+    editorSetStatusMessage("Finished the save of %s that was cut short", filename);
 }
 
-// -----------------------------------------------------------
-// Write the string returned by `editorRowsToString()` to disk
-// -----------------------------------------------------------
-void editorSave()
+// ----------------------------------------------------------------------
+// Offer to redo the edits in a journal left behind next to the file that
+// was just opened, `st` being what it was opened as. Only a journal that
+// is newer than the file, and written against this very version of it,
+// is any use. Recovered edits carry on in the same journal.
+// ----------------------------------------------------------------------
+void editorJournalRecover(struct stat* st)
 {
-    // New file
-    if(E.filename == NULL)
+    struct journal* j = &E.journal;
+
+    free(j->name);
+    j->name = editorJournalName(E.filename, "journal");
+
+    int fd = open(j->name, O_RDWR | O_CLOEXEC);
+    if(fd == -1)
+        return;
+
+    struct stat jst;
+    struct journalHeader h;
+    if(fstat(fd, &jst) == -1 || jst.st_mtim.tv_sec < st->st_mtim.tv_sec ||
+       (jst.st_mtim.tv_sec == st->st_mtim.tv_sec && jst.st_mtim.tv_nsec < st->st_mtim.tv_nsec) ||
+       pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, "attojnl1", sizeof(h.magic)) != 0 ||
+       h.size != (uint64_t)st->st_size || h.mtime != st->st_mtim.tv_sec || h.mtime_nsec != st->st_mtim.tv_nsec ||
+       jst.st_size <= (off_t)sizeof(h))
     {
-        E.filename = editorPrompt("Save as : %s (ESC to cancel)");
-        if(E.filename == NULL)
-        {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+        close(fd);
+        return;
     }
 
-    int len;
-    char* buf = editorRowsToString(&len);
+    // Only an explicit answer either way, so a stray key can't lose the edits
+    int answer = 0;
+    while(answer != 'y' && answer != 'n')
+    {
+        char* reply = editorPrompt("Unsaved changes were found, recover them? (y/n) : %s");
+        if(reply == NULL)
+            break;
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);      // 0644 is the standard permissions for text files
-    
-    // Error handling for file
-    if(fd != -1)
+        answer = tolower((unsigned char)reply[0]);
+        free(reply);
+    }
+
+    if(answer == 'n')
+    {
+        close(fd);
+        unlink(j->name);
+        editorSetStatusMessage("Unsaved changes discarded");
+        return;
+    }
+
+    // ESC leaves the journal as it is, and this session logs nothing
+    if(answer != 'y')
     {
-        if(ftruncate(fd, len) != -1)
-        {
-            if(write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
         close(fd);
+        j->kept = 1;
+        editorSetStatusMessage("Unsaved changes left in %s, new edits are not journaled", j->name);
+        return;
+    }
+
+    size_t len = jst.st_size - sizeof(h);
+    char* buf = malloc(len);
+    if(buf == NULL)
+        die("malloc");
+
+    size_t got = 0;
+    while(got < len)
+    {
+        ssize_t n = pread(fd, &buf[got], len - got, sizeof(h) + got);
+        if(n == -1 && errno != EINTR)
+            die("read");
+        if(n == 0)
+            break;
+        if(n > 0)
+            got += n;
+    }
+
+    // The edits apply to every row
+    editorIndexRows(INT_MAX);
+
+    j->replaying = 1;
+
+    size_t off = 0;
+    int n = 0;
+    while(off + sizeof(struct journalRecord) <= got)
+    {
+        struct journalRecord r;
+        memcpy(&r, &buf[off], sizeof(r));
+
+        if(r.len > got - off - sizeof(r) || !editorJournalApply(&r, &buf[off + sizeof(r)]))
+            break;
+
+        off += sizeof(r) + r.len;
+        ++n;
     }
+
+    j->replaying = 0;
     free(buf);
-    editorSetStatusMessage("Can't save! I/O error : %s", strerror(errno));
+
+    // Drop whatever was cut short by the crash, and log new edits after
+    // the ones that were redone
+    j->fd = fd;
+    j->size = sizeof(h) + off;
+    ftruncate(fd, j->size);
+
+    editorSetStatusMessage("Recovered %d unsaved edits", n);
 }
 
 /*** Append Buffer ***/
@@ -704,31 +4728,139 @@ struct abuf
 {
     char* b;
     int len;
+    int cap;    // Bytes allocated for `b`
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+
+// Counts of appends and of the allocations they needed, for `atto-bench frame`
+struct abStats
+{
+    long appends;
+    long allocs;
+} abStats;
+
+// -------------------------------------------------------------------
+// Make room for `len` more bytes, doubling the capacity when it grows
+// -------------------------------------------------------------------
+int abReserve(struct abuf* ab, int len)
+{
+    ++abStats.appends;
+
+    if(ab->len + len <= ab->cap)
+        return 0;
+
+    int cap = ab->cap ? ab->cap * 2 : 256;
+    while(cap < ab->len + len)
+    {
+        cap *= 2;
+    }
+
+    char* new = realloc(ab->b, cap);
+    if(new == NULL)
+        return -1;
+
+    ++abStats.allocs;
+    ab->b = new;
+    ab->cap = cap;
+    return 0;
+}
 
 // ------------------------------
 // Append to our "Dynamic String"
 // ------------------------------
 void abAppend(struct abuf* ab, const char* s, int len)
 {
-    char* new = realloc(ab->b, ab->len + len);
+    if(abReserve(ab, len) == -1)
+        return;
 
-    if(new == NULL)
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+// ---------------------------------
+// Append `n` copies of character `c`
+// ---------------------------------
+void abFill(struct abuf* ab, char c, int n)
+{
+    if(n <= 0 || abReserve(ab, n) == -1)
         return;
 
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
+
+// ------------------------------------------
+// Append text formatted like with `printf()`
+// ------------------------------------------
+void abPrintf(struct abuf* ab, const char* fmt, ...)
+{
+    char buf[64];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if(len < 0)
+        return;
+
+    if(len < (int)sizeof(buf))
+    {
+        abAppend(ab, buf, len);
+        return;
+    }
+
+    // Too long for `buf`, so format straight into the string
+    if(abReserve(ab, len + 1) == -1)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(&ab->b[ab->len], len + 1, fmt, ap);
+    va_end(ap);
     ab->len += len;
 }
 
+// -----------------------------------------------------
+// Empty the "Dynamic String", keeping its memory for reuse
+// -----------------------------------------------------
+void abReset(struct abuf* ab)
+{
+    ab->len = 0;
+}
+
 // --------------------------------------
 // Deallocates memory of "Dynamic String"
 // --------------------------------------
 void abFree(struct abuf* ab)
 {
-    free(ab->b);
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+// -----------------------------------------------------------------
+// Append `len` bytes of the render string of a row, from `at` onwards
+// -----------------------------------------------------------------
+void abAppendRender(struct abuf* ab, erow* row, int at, int len)
+{
+    if(!(row->flags & ROW_GAP) || at + len <= row->gap)
+    {
+        abAppend(ab, &row->render[at], len);
+        return;
+    }
+
+    int gaplen = editorRowGap(row)->cap - row->rsize;
+
+    if(at >= row->gap)
+    {
+        abAppend(ab, &row->render[at + gaplen], len);
+        return;
+    }
+
+    abAppend(ab, &row->render[at], row->gap - at);
+    abAppend(ab, &row->render[row->gap + gaplen], len - (row->gap - at));
 }
 
 /*** Output ***/
@@ -738,11 +4870,11 @@ void abFree(struct abuf* ab)
 // ---------------------------------
 void editorScroll()
 {
-    // Convert `chars` index to `render` index
+    // Convert text index to `render` index
     E.rx = 0;
     if(E.cy < E.numrows)
     {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     // Vertical scrolling
@@ -768,66 +4900,54 @@ void editorScroll()
     }
 }
 
-// --------------------------
-// Draw Tilde On Left of Rows
-// --------------------------
-void editorDrawRows(struct abuf *ab)
+// -----------------------------------------
+// Draw Screen Line `y`, With Tilde Past EOF
+// -----------------------------------------
+void editorDrawRow(struct abuf* ab, int y)
 {
-    int y;
-    for(y = 0; y < E.screenrows; ++y)
+    // Display the correct range of lines of the file according to the value of `rowoff`
+    int filerow = y + E.rowoff;
+    if(filerow >= E.numrows)
     {
-        // Display the correct range of lines of the file according to the value of `rowoff`
-        int filerow = y + E.rowoff;
-        if(filerow >= E.numrows)
+        // Draw welcome message on when use start the program with no arguments
+        if (E.numrows == 0 && y == E.screenrows / 3)
         {
-            // Draw welcome message on when use start the program with no arguments
-            if (E.numrows == 0 && y == E.screenrows / 3)
-            {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome), "Atto editor -- version %s", ATTO_VERSION);
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome), "Atto editor -- version %s", ATTO_VERSION);
 
-                if(welcomelen > E.screencols)
-                    welcomelen = E.screencols;
+            if(welcomelen > E.screencols)
+                welcomelen = E.screencols;
 
-                int padding = (E.screencols - welcomelen) / 2;
+            int padding = (E.screencols - welcomelen) / 2;
 
-                if(padding)
-                {
-                    abAppend(ab, "~", 1);
-                    --padding;
-                }
-
-                while(padding--)
-                {
-                    abAppend(ab, " ", 1);
-                }
-
-                abAppend(ab, welcome, welcomelen);
-            }
-            else
+            if(padding)
             {
-                // Add tilde to rows
                 abAppend(ab, "~", 1);
+                --padding;
             }
+
+            abFill(ab, ' ', padding);
+
+            abAppend(ab, welcome, welcomelen);
         }
         else
         {
-            // Append text from opened file as rows to terminal
-            int len = E.row[filerow].rsize - E.coloff;
-            if(len < 0)
-                len = 0;
-            if(len > E.screencols)
-                len = E.screencols;
-            
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            // Add tilde to rows
+            abAppend(ab, "~", 1);
         }
+    }
+    else
+    {
+        // Append text from opened file as rows to terminal
+        erow* row = editorRowAt(filerow);
+        editorRenderRow(row);
 
-
-        // Clear each line as we redraw
-        abAppend(ab, "\x1b[K", 3);
-
-        // Append newline to every line
-        abAppend(ab, "\r\n", 2);
+        int len = row->rsize - E.coloff;
+        if(len > E.screencols)
+            len = E.screencols;
+        
+        if(len > 0)
+            abAppendRender(ab, row, E.coloff, len);
     }
 }
 
@@ -839,10 +4959,20 @@ void editorDrawStatusBar(struct abuf* ab)
     abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
 
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
+    // Lines that have not been indexed yet are shown with a `+`
+    const char* more = E.tb.indexed < E.tb.origlen ? "+" : "";
+
+    char lines[40];
+    if(E.load.active)
+        snprintf(lines, sizeof(lines), "%d+ lines, loading %d%%", E.numrows, (int)(E.tb.indexed * 100 / E.tb.origlen));
+    else
+        snprintf(lines, sizeof(lines), "%d%s lines", E.numrows, more);
+
+    int len = snprintf(status, sizeof(status), "%.20s - %s %s%s",
+                       E.filename ? E.filename : "[No Name]", lines, E.dirty ? "(modified) " : "",
+                       E.save.active ? "(saving)" : "");
 
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d%s", E.cy + 1, E.numrows, more);
 
     if(len > E.screencols)
     {
@@ -851,21 +4981,17 @@ void editorDrawStatusBar(struct abuf* ab)
 
     abAppend(ab, status, len);
 
-    while(len < E.screencols)
+    // Right-align the line number, if it fits
+    if(E.screencols - len >= rlen)
     {
-        if(E.screencols - len == rlen)
-        {
-            abAppend(ab, rstatus, rlen);
-            break;
-        }
-        else
-        {
-            abAppend(ab, " ", 1);
-            ++len;
-        }
+        abFill(ab, ' ', E.screencols - len - rlen);
+        abAppend(ab, rstatus, rlen);
+    }
+    else
+    {
+        abFill(ab, ' ', E.screencols - len);
     }
     abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
 // -----------------------------------------
@@ -880,57 +5006,189 @@ void editorDrawMessageBar(struct abuf* ab)
     if(msglen > E.screencols)
         msglen = E.screencols;
 
-    if(msglen && time(NULL) - E.statusmsg_time < 5)
+    if(msglen && time(NULL) - E.statusmsg_time < ATTO_STATUS_TIMEOUT)
         abAppend(ab, E.statusmsg, msglen);
 }
 
-// ------------
-// Clear Screen
-// ------------
+// ----------------------------------
+// FNV-1a hash of a line of the screen
+// ----------------------------------
+uint64_t editorHashLine(const char* s, int len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    int i;
+    for(i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// -------------------------------------------------------------------
+// Shift the text rows on the terminal up by `d` lines (down if `d` is
+// negative) inside a scroll region, and shift their hashes to match.
+// The rows that scroll into view are blank.
+// -------------------------------------------------------------------
+void editorScrollScreen(struct abuf* ab, int d)
+{
+    int n = abs(d);
+    int y;
+
+    // Limit scrolling to the text rows, then index down from the last
+    // one, or reverse index up from the first one
+    abPrintf(ab, "\x1b[1;%dr\x1b[%d;1H", E.screenrows, d > 0 ? E.screenrows : 1);
+
+    for(y = 0; y < n; ++y)
+    {
+        abAppend(ab, d > 0 ? "\x1b" "D" : "\x1b" "M", 2);
+    }
+
+    // Back to the whole screen
+    abAppend(ab, "\x1b[r", 3);
+
+    uint64_t blank = editorHashLine("", 0);
+    if(d > 0)
+    {
+        memmove(E.screen.hashes, &E.screen.hashes[n], sizeof(uint64_t) * (E.screenrows - n));
+        for(y = E.screenrows - n; y < E.screenrows; ++y)
+            E.screen.hashes[y] = blank;
+    }
+    else
+    {
+        memmove(&E.screen.hashes[n], E.screen.hashes, sizeof(uint64_t) * (E.screenrows - n));
+        for(y = 0; y < n; ++y)
+            E.screen.hashes[y] = blank;
+    }
+}
+
+// ---------------------------------------------------------------------
+// Redraw the screen. Each line is drawn and hashed, and only lines that
+// differ from what the terminal already shows are sent.
+// ---------------------------------------------------------------------
 void editorRefreshScreen()
 {
+    // Make sure every row that can end up on screen has been indexed
+    editorIndexRows(E.cy + E.screenrows + 1);
+
     // Enable scrolling
     editorScroll();
 
-    // Create our "Dynamic String"
-    struct abuf ab = ABUF_INIT;
+    // Text rows, then the status bar and the message bar
+    int nlines = E.screenrows + 2;
+    if(E.screen.nlines != nlines)
+    {
+        E.screen.hashes = realloc(E.screen.hashes, sizeof(uint64_t) * nlines);
+        if(E.screen.hashes == NULL)
+            die("realloc");
+
+        E.screen.nlines = nlines;
+        E.screen.valid = 0;
+    }
+
+    // Create our "Dynamic String". It and the buffer for single lines
+    // keep their memory from one frame to the next.
+    static struct abuf ab = ABUF_INIT;
+    static struct abuf line = ABUF_INIT;
+    abReset(&ab);
 
-    // Hide the cursor while repainting
+    // Have the terminal show the frame all at once, and hide the cursor
+    // while repainting
+    if(E.screen.sync)
+        abAppend(&ab, "\x1b[?2026h", 8);
     abAppend(&ab, "\x1b[?25l", 6);
+    int start = ab.len;
 
-    // The 4 in `write()` means we are writing 4 bytes out to the terminal.
-    // The first byte is "\x1b", which is the escape character, or 27 in decimal.
-    // Escape sequences always start with an escape character (27) followed by '['.
-    // We are using the 'J' command (Erase In Display) to clear the screen. In this case,
-    // the argument is 2, which says to clear the entire screen.
-    // "<esc>[1J" would clear the screen up to where the cursor is.
-    // "<esc>[0J" would clear the screen from the cursor up to the end of the screen.
-    // abAppend(&ab, "\x1b[2J", 4);         // No longer clearing entire screen. Now clearing line-by-line
+    // When the view moved by less than a screen, let the terminal shift
+    // what it already shows. Only the text rows are in the scroll region,
+    // so the status and message bars stay where they are.
+    int d = E.rowoff - E.screen.rowoff;
+    if(E.screen.valid && E.screen.scroll && d != 0 && abs(d) < E.screenrows)
+        editorScrollScreen(&ab, d);
 
-    // Reposition the cursor to the top-left corner.
-    // The 'H' command actually takes in two arguments.
-    // For example, we could use "<esc>[12;40H".
-    abAppend(&ab, "\x1b[H", 3);
+    E.screen.rowoff = E.rowoff;
 
-    // Draw rows with tilde
-    editorDrawRows(&ab);
+    int y;
+    for(y = 0; y < nlines; ++y)
+    {
+        abReset(&line);
+
+        if(y < E.screenrows)
+            editorDrawRow(&line, y);
+        else if(y == E.screenrows)
+            editorDrawStatusBar(&line);
+        else
+            editorDrawMessageBar(&line);
 
-    // Draw status bar
-    editorDrawStatusBar(&ab);
+        uint64_t h = editorHashLine(line.b, line.len);
+        if(E.screen.valid && E.screen.hashes[y] == h)
+            continue;
+
+        E.screen.hashes[y] = h;
+
+        // Move to the start of the line. The 'H' command takes the row and
+        // the column, counting from 1.
+        abPrintf(&ab, "\x1b[%d;1H", y + 1);
+        abAppend(&ab, line.b, line.len);
+
+        // Clear the rest of each text row. The status bar fills the whole
+        // width and the message bar clears itself first.
+        if(y < E.screenrows)
+            abAppend(&ab, "\x1b[K", 3);
+    }
 
-    // Draw message bar
-    editorDrawMessageBar(&ab);
+    E.screen.valid = 1;
 
     // Move cursor to position stored in `E.cx` and `E.cy`
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int cy = (E.cy - E.rowoff) + 1;
+    int cx = (E.rx - E.coloff) + 1;
+    int repainted = ab.len > start;
+
+    if(!repainted)
+        abReset(&ab);
+
+    if(!repainted && cy == E.screen.cy && cx == E.screen.cx)
+        return;
+
+    abPrintf(&ab, "\x1b[%d;%dH", cy, cx);
+    E.screen.cy = cy;
+    E.screen.cx = cx;
 
     // Show the cursor after repainting
-    abAppend(&ab, "\x1b[?25h", 6);
+    if(repainted)
+    {
+        abAppend(&ab, "\x1b[?25h", 6);
+        if(E.screen.sync)
+            abAppend(&ab, "\x1b[?2026l", 8);
+    }
+
+    editorWriteAll(ab.b, ab.len);
+}
+
+// ----------------------------------------------------------------------
+// Pick up a new terminal size. Only the layout depends on it: the cursor
+// is brought back into view and the whole screen is drawn again once.
+// ----------------------------------------------------------------------
+void editorResize()
+{
+    E.resize_time = 0;
+
+    int rows, cols;
+    if(getWindowSize(&rows, &cols) == -1)
+        return;
+
+    // Leave room for at least one row of text
+    E.screenrows = rows > 3 ? rows - 2 : 1;
+    E.screencols = cols > 1 ? cols : 1;
+
+    // Clamp `E.rowoff` and `E.coloff` so the cursor is on screen
+    editorScroll();
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    // The terminal may have reflowed or cleared what it showed
+    E.screen.valid = 0;
+    editorRefreshScreen();
 }
 
 // ------------------
@@ -987,6 +5245,23 @@ char* editorPrompt(char* prompt)
                 return buf;
             }
         }
+        // User pastes text. Only its first line is taken.
+        else if(c == PASTE)
+        {
+            int i;
+            for(i = 0; i < E.input.pastelen && E.input.paste[i] != '\r' && E.input.paste[i] != '\n'; ++i)
+            {
+                if(buflen == bufsize - 1)
+                {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                if(!iscntrl((unsigned char)E.input.paste[i]))
+                    buf[buflen++] = E.input.paste[i];
+            }
+            buf[buflen] = '\0';
+            E.input.pastelen = 0;
+        }
         // User types in alphanumeric
         else if(!iscntrl(c) && c < 128)
         {
@@ -1007,7 +5282,7 @@ char* editorPrompt(char* prompt)
 void editorMoveCursor(int key)
 {
     // Limit horizontal right scrolling to the last character in row
-    erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow* row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
     switch(key)
     {
@@ -1021,7 +5296,7 @@ void editorMoveCursor(int key)
             {
                 // Move to end of previous line if at start of current line
                 --E.cy;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -1040,20 +5315,28 @@ void editorMoveCursor(int key)
         case ARROW_UP:
             if(E.cy != 0)
             {
+                // Stay in the same screen column, whatever the tabs
+                int rx = row ? editorRowCxToRx(row, E.cx) : 0;
+
                 --E.cy;
+                E.cx = editorRowRxToCx(editorRowAt(E.cy), rx);
             }
             break;
         case ARROW_DOWN:
             if(E.cy < E.numrows)
             {
+                int rx = editorRowCxToRx(row, E.cx);
+
                 ++E.cy;
+                if(E.cy < E.numrows)
+                    E.cx = editorRowRxToCx(editorRowAt(E.cy), rx);
             }
             break;
     }
 
     // Snap cursor to end of line
     // --------------------------
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if(E.cx > rowlen)
     {
@@ -1070,6 +5353,9 @@ void editorProcessKeypress()
 
     int c = editorReadKey();
 
+    // Index far enough ahead for a page of movement from the screen
+    editorIndexRows(E.rowoff + 2 * E.screenrows + 1);
+
     switch(c)
     {
         // ENTER key
@@ -1079,6 +5365,9 @@ void editorProcessKeypress()
 
         // Exit
         case CTRL_KEY('q'):
+            // A save in progress has to end first, and may leave nothing unsaved
+            editorSaveFinish();
+
             if(E.dirty && quit_times > 0)
             {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. "
@@ -1086,6 +5375,9 @@ void editorProcessKeypress()
                 --quit_times;
                 return;
             }
+
+            // Unsaved edits were given up on
+            editorJournalRemove();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1105,7 +5397,7 @@ void editorProcessKeypress()
         case END_KEY:
             if(E.cy < E.numrows)
             {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
 
@@ -1150,8 +5442,19 @@ void editorProcessKeypress()
             editorMoveCursor(c);
             break;
 
-        // (Ctrl + l) and ESC key
+        // Bracketed paste
+        case PASTE:
+            editorInsertText(E.input.paste, E.input.pastelen);
+            E.input.pastelen = 0;
+            break;
+
+        // (Ctrl + l) repaints the whole screen, in case something else
+        // wrote over it
         case CTRL_KEY('l'):
+            E.screen.valid = 0;
+            break;
+
+        // ESC key
         case '\x1b':
             break;
 
@@ -1163,6 +5466,24 @@ void editorProcessKeypress()
     quit_times = ATTO_QUIT_TIMES;
 }
 
+// --------------------------------------------------------------------
+// Process a key, then every other key that is already waiting, for up
+// to ATTO_INPUT_BUDGET ms, so that a burst of typing, key repeat or a
+// paste is drawn in a single frame
+// --------------------------------------------------------------------
+void editorProcessInput()
+{
+    editorProcessKeypress();
+
+    long long start = editorNowMs();
+    while(editorInputPending() && editorNowMs() - start < ATTO_INPUT_BUDGET)
+    {
+        // Keys like PAGE UP depend on where the screen has scrolled to
+        editorScroll();
+        editorProcessKeypress();
+    }
+}
+
 /*** Init ***/
 
 // --------------------------
@@ -1183,11 +5504,25 @@ void initEditor()
 
     // Rows of text from file
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = rsNewLeaf();
+
+    // No file being loaded
+    E.load.active = 0;
+    E.load.maxthreads = 0;
+
+    // Piece table holding the text of the rows
+    E.tb.orig = NULL;
+    E.tb.origlen = 0;
+    E.tb.mapped = 0;
+    E.tb.indexed = 0;
+    E.tb.add = NULL;
 
     // Dirty flag (unsaved changes)
     E.dirty = 0;
 
+    // Nothing on disk yet, so every row needs saving
+    E.dirtyrow = 0;
+
     // Name of file
     E.filename = NULL;
 
@@ -1195,6 +5530,13 @@ void initEditor()
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
 
+    // Signals are not read until `enableSignals()`
+    E.sigfd = -1;
+    E.resize_time = 0;
+
+    // No journal until the first edit
+    E.journal.fd = -1;
+
     if(getWindowSize(&E.screenrows, &E.screencols) == -1)
     {
         die("getWindowSize");
@@ -1202,8 +5544,361 @@ void initEditor()
 
     // Last row excluded for status bar
     E.screenrows -= 2;
+
+    // Nothing drawn on the terminal yet
+    E.screen.hashes = NULL;
+    E.screen.nlines = 0;
+    E.screen.valid = 0;
+    E.screen.scroll = getScrollRegions();
+    E.screen.sync = getSyncOutput();
+
+    tbScanInit();
+}
+
+#ifdef ATTO_BENCH
+
+/*** Benchmarks ***/
+
+// ---------------------------
+// Monotonic time in seconds
+// ---------------------------
+double benchNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// -------------------------------------------------------------------
+// Compare splitting a file into lines with `getline()` (how files used
+// to be opened) against each newline scanner
+// -------------------------------------------------------------------
+void benchScan(char* filename)
+{
+    double t = benchNow();
+    long lines = 0;
+
+    FILE* fp = fopen(filename, "r");
+    if(!fp)
+        die("fopen");
+
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        {
+            --linelen;
+        }
+        ++lines;
+    }
+    free(line);
+    fclose(fp);
+
+    t = benchNow() - t;
+    printf("%-8s %12ld lines %10.3f s\n", "getline", lines, t);
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+        die("open");
+
+    char* buf = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(buf == MAP_FAILED)
+        die("mmap");
+    close(fd);
+
+    struct
+    {
+        const char* name;
+        int (*scan)(const char*, size_t, uint32_t*, int, size_t*);
+        int supported;
+    } scanners[] = {
+        { "scalar", tbScanLinesScalar, 1 },
+#ifdef ATTO_SCAN_SIMD
+        { "sse2", tbScanLinesSse2, __builtin_cpu_supports("sse2") },
+        { "avx2", tbScanLinesAvx2, __builtin_cpu_supports("avx2") },
+#endif
+    };
+
+    static uint32_t offs[ATTO_SCAN_ROWS];
+    unsigned int k;
+    for(k = 0; k < sizeof(scanners) / sizeof(scanners[0]); ++k)
+    {
+        if(!scanners[k].supported)
+        {
+            printf("%-8s not supported by this CPU\n", scanners[k].name);
+            continue;
+        }
+
+        t = benchNow();
+        lines = 0;
+
+        size_t off = 0;
+        while(off < (size_t)st.st_size)
+        {
+            size_t blocklen = st.st_size - off < ATTO_SCAN_BLOCK ? st.st_size - off : ATTO_SCAN_BLOCK;
+            size_t done;
+            int n = scanners[k].scan(&buf[off], blocklen, offs, ATTO_SCAN_ROWS, &done);
+
+            lines += n;
+            off += done;
+        }
+
+        // Count a last line without a line break, as `getline()` does
+        if(st.st_size > 0 && buf[st.st_size - 1] != '\n')
+            ++lines;
+
+        t = benchNow() - t;
+        printf("%-8s %12ld lines %10.3f s %10.1f MB/s\n", scanners[k].name, lines, t, st.st_size / t / 1e6);
+    }
+
+    munmap(buf, st.st_size ? st.st_size : 1);
+}
+
+// -------------------------------------------------------------------
+// Time loading a whole file into rows on one thread and on all of them
+// -------------------------------------------------------------------
+void benchLoad(char* filename)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu > ATTO_LOAD_THREADS_MAX)
+        ncpu = ATTO_LOAD_THREADS_MAX;
+
+    int nthreads;
+    for(nthreads = 1; nthreads <= ncpu; nthreads = (nthreads == ncpu) ? ncpu + 1 : ncpu)
+    {
+        // Start again from an empty editor
+        arenaRelease();
+        memset(&E, 0, sizeof(E));
+        E.rows = rsNewLeaf();
+        E.load.maxthreads = nthreads;
+
+        double t = benchNow();
+        editorOpen(filename);
+        editorIndexRows(INT_MAX);
+        t = benchNow() - t;
+
+        printf("%3d threads %12d rows %10.3f s\n", nthreads, E.numrows, t);
+    }
+}
+
+// -------------------------------------------------------------------
+// Type characters into random rows, growing each row's text and render
+// string as it changes, first with `malloc()` per row (how rows used to
+// be kept) and then with the editor's own allocator
+// -------------------------------------------------------------------
+void benchAlloc(char* filename)
+{
+    const long keys = 4000000;
+
+    memset(&E, 0, sizeof(E));
+    E.rows = rsNewLeaf();
+    editorOpen(filename);
+    editorIndexRows(INT_MAX);
+
+    int nrows = E.numrows;
+    if(nrows == 0)
+    {
+        fprintf(stderr, "%s has no lines\n", filename);
+        return;
+    }
+
+    struct brow { char* chars; char* render; int size; }* rows = calloc(nrows, sizeof(struct brow));
+    long k;
+
+    srand(1);
+    double t = benchNow();
+    for(k = 0; k < keys; ++k)
+    {
+        struct brow* row = &rows[rand() % nrows];
+
+        row->chars = realloc(row->chars, row->size + 1);
+        row->chars[row->size++] = 'x';
+
+        free(row->render);
+        row->render = malloc(row->size);
+        memcpy(row->render, row->chars, row->size);
+    }
+    t = benchNow() - t;
+
+    for(k = 0; k < nrows; ++k)
+    {
+        free(rows[k].chars);
+        free(rows[k].render);
+    }
+    memset(rows, 0, nrows * sizeof(*rows));
+
+    printf("%-8s %12ld calls %10.3f s\n", "malloc", keys * 3, t);
+
+    struct arenaStats before = E.tb.arena.stats;
+
+    srand(1);
+    t = benchNow();
+    for(k = 0; k < keys; ++k)
+    {
+        struct brow* row = &rows[rand() % nrows];
+
+        row->chars = arenaRealloc(row->chars, row->size, row->size + 1);
+        row->chars[row->size++] = 'x';
+
+        row->render = arenaRealloc(row->render, row->size - 1, row->size);
+        memcpy(row->render, row->chars, row->size);
+    }
+    t = benchNow() - t;
+
+    struct arenaStats* st = &E.tb.arena.stats;
+    printf("%-8s %12ld allocs %9.3f s %10ld from malloc\n", "arena",
+           st->allocs - before.allocs, t, st->sysallocs - before.sysallocs);
+    printf("%-8s %12zu bytes asked %12zu in use %12zu reserved\n", "",
+           st->requested, st->used, st->reserved);
+
+    free(rows);
+}
+
+// -------------------------------------------------------------------
+// Draw frames while moving the cursor down through a file, and count
+// the appends and allocations each frame makes
+// -------------------------------------------------------------------
+void benchFrame(char* filename)
+{
+    const int frames = 2000;
+
+    memset(&E, 0, sizeof(E));
+    E.rows = rsNewLeaf();
+    E.screenrows = 48;
+    E.screencols = 160;
+    editorOpen(filename);
+    editorIndexRows(INT_MAX);
+
+    // Frames go nowhere
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(out == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1)
+        die("dup");
+    close(null);
+
+    abStats.appends = 0;
+    abStats.allocs = 0;
+
+    double t = benchNow();
+    int i;
+    for(i = 0; i < frames; ++i)
+    {
+        if(E.cy < E.numrows)
+            ++E.cy;
+        editorRefreshScreen();
+    }
+    t = benchNow() - t;
+
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    printf("%d frames %10.3f ms/frame %8.1f appends/frame %8.3f allocs/frame\n", frames,
+           t * 1000 / frames, (double)abStats.appends / frames, (double)abStats.allocs / frames);
+}
+
+// -------------------------------------------------------------------
+// Time saving a copy of a file after typing a character at different
+// rows, writing the whole file and then only from that row on
+// -------------------------------------------------------------------
+void benchSave(char* filename)
+{
+    char* copy = malloc(strlen(filename) + 7);
+    sprintf(copy, "%s.bench", filename);
+
+    int in = open(filename, O_RDONLY);
+    int out = open(copy, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(in == -1 || out == -1)
+        die("open");
+
+    char buf[65536];
+    ssize_t n;
+    while((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        if(write(out, buf, n) != n)
+            die("write");
+    }
+    close(in);
+    close(out);
+
+    memset(&E, 0, sizeof(E));
+    E.rows = rsNewLeaf();
+    E.journal.fd = -1;
+    editorOpen(copy);
+    editorIndexRows(INT_MAX);
+
+    const int at[] = { 0, 25, 50, 75, 90, 99, 100 };
+    unsigned int k;
+    for(k = 0; k < sizeof(at) / sizeof(at[0]); ++k)
+    {
+        E.cy = (int)((long long)E.numrows * at[k] / 100);
+        E.cx = 0;
+
+        editorInsertChar('x');
+        E.save.known = 0;
+        double t = benchNow();
+        editorSave();
+        editorSaveFinish();
+        double full = benchNow() - t;
+
+        editorInsertChar('x');
+        t = benchNow();
+        editorSave();
+        editorSaveFinish();
+        double part = benchNow() - t;
+
+        printf("row %3d%% %12zu bytes %12zu rewritten %8.3f s %8.3f s full\n", at[k],
+               E.save.len, E.save.rewritten, part, full);
+    }
+
+    editorJournalRemove();
+    unlink(copy);
+    free(copy);
+}
+
+int main(int argc, char* argv[])
+{
+    tbScanInit();
+
+    if(argc == 3 && strcmp(argv[1], "scan") == 0)
+    {
+        benchScan(argv[2]);
+        return 0;
+    }
+
+    if(argc == 3 && strcmp(argv[1], "load") == 0)
+    {
+        benchLoad(argv[2]);
+        return 0;
+    }
+
+    if(argc == 3 && strcmp(argv[1], "alloc") == 0)
+    {
+        benchAlloc(argv[2]);
+        return 0;
+    }
+
+    if(argc == 3 && strcmp(argv[1], "frame") == 0)
+    {
+        benchFrame(argv[2]);
+        return 0;
+    }
+
+    if(argc == 3 && strcmp(argv[1], "save") == 0)
+    {
+        benchSave(argv[2]);
+        return 0;
+    }
+
+    fprintf(stderr, "usage : atto-bench scan|load|alloc|frame|save <file>\n");
+    return 1;
 }
 
+#else
+
 int main(int argc, char* argv[])
 {
     // Set terminal to raw mode from canonical mode
@@ -1212,18 +5907,35 @@ int main(int argc, char* argv[])
     // Initialize editor
     initEditor();
 
+    // Read signals in the event loop, before the loader starts any threads
+    enableSignals();
+
+    // Set before opening, so the outcome of recovering a journal replaces it
+    editorSetStatusMessage("HELP : Ctrl-S = save | Ctrl-Q = quit");
+
     // Open file
     if(argc >= 2)
     {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP : Ctrl-S = save | Ctrl-Q = quit");
-
     while(1)
     {
-        editorRefreshScreen();
-        editorProcessKeypress();
+        // Draw once per burst of input, and skip frames while the
+        // terminal is still busy with an earlier one
+        if(editorWaitOutput())
+            editorRefreshScreen();
+
+        // The mapped file was cut short on disk
+        if(E.tb.cut)
+        {
+            tbDetachFile();
+            continue;
+        }
+
+        editorProcessInput();
     }
     return 0;
-}
\ No newline at end of file
+}
+
+#endif